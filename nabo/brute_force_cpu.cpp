@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "nabo_private.h"
 #include "index_heap.h"
+#include <algorithm>
 
 /*!	\file brute_force_cpu.cpp
 	\brief brute force search, cpu implementation
@@ -41,9 +42,10 @@ namespace Nabo
 {
 	using namespace std;
 	
-	template<typename T>
-	BruteForceSearch<T>::BruteForceSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags):
-		NearestNeighbourSearch<T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags)
+	template<typename T, typename Cloud_T>
+	BruteForceSearch<T, Cloud_T>::BruteForceSearch(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters):
+		NearestNeighbourSearch<T, Cloud_T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags),
+		gemmBlockSize(additionalParameters.get<unsigned>("gemmBlockSize", 0))
 	{
 #ifdef EIGEN3_API
 		const_cast<Vector&>(this->minBound) = cloud.topRows(this->dim).rowwise().minCoeff();
@@ -57,25 +59,34 @@ namespace Nabo
 			const_cast<Vector&>(this->maxBound) = this->maxBound.cwise().max(v);
 		}
 #endif // EIGEN3_API
+		if (gemmBlockSize > 0)
+		{
+			cloudNorms2.resize(cloud.cols());
+			for (int i = 0; i < cloud.cols(); ++i)
+				cloudNorms2(i) = cloud.block(0,i,this->dim,1).squaredNorm();
+		}
 	}
 	
 
-	template<typename T>
-	unsigned long BruteForceSearch<T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	template<typename T, typename Cloud_T>
+	unsigned long BruteForceSearch<T, Cloud_T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
 		const Vector maxRadii(Vector::Constant(query.cols(), maxRadius));
 		return knn(query, indices, dists2, maxRadii, k, epsilon, optionFlags);
 	}
 	
-	template<typename T>
-	unsigned long BruteForceSearch<T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
+	template<typename T, typename Cloud_T>
+	unsigned long BruteForceSearch<T, Cloud_T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
 	{
 		checkSizesKnn(query, indices, dists2, k, optionFlags, &maxRadii);
 		
-		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
-		const bool sortResults(optionFlags & NearestNeighbourSearch<T>::SORT_RESULTS);
-		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
 		
+		if (gemmBlockSize > 0)
+			return knnBlocked(query, indices, dists2, maxRadii, k, optionFlags);
+
 		IndexHeapSTL<Index, T> heap(k);
 		
 		for (int c = 0; c < query.cols(); ++c)
@@ -102,6 +113,93 @@ namespace Nabo
 			return 0;
 	}
 	
+	template<typename T, typename Cloud_T>
+	unsigned long BruteForceSearch<T, Cloud_T>::knnBlocked(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const unsigned optionFlags) const
+	{
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
+		const int colCount(query.cols());
+		const int cloudCount(this->cloud.cols());
+		const int block(gemmBlockSize);
+
+#ifdef HAVE_OPENMP
+		#pragma omp parallel
+#endif // HAVE_OPENMP
+		{
+
+		// per-thread tile scratch and heaps, one heap per query of the tile
+		Matrix cross(block, block);
+		Vector queryNorms2(block);
+		std::vector<IndexHeapSTL<Index, T> > heaps(block, IndexHeapSTL<Index, T>(k));
+
+#ifdef HAVE_OPENMP
+		#pragma omp for schedule(dynamic)
+#endif // HAVE_OPENMP
+		for (int q0 = 0; q0 < colCount; q0 += block)
+		{
+			const int qCount(min(block, colCount - q0));
+			for (int j = 0; j < qCount; ++j)
+			{
+				queryNorms2(j) = query.block(0, q0 + j, dim, 1).squaredNorm();
+				heaps[j].reset();
+			}
+			for (int p0 = 0; p0 < cloudCount; p0 += block)
+			{
+				const int pCount(min(block, cloudCount - p0));
+				// cross-terms of the tile in one matrix product: cross(i,j) = p_i . q_j
+#ifdef EIGEN3_API
+				cross.block(0, 0, pCount, qCount).noalias() = this->cloud.block(0, p0, dim, pCount).transpose() * query.block(0, q0, dim, qCount);
+#else // EIGEN3_API
+				cross.block(0, 0, pCount, qCount) = this->cloud.block(0, p0, dim, pCount).transpose() * query.block(0, q0, dim, qCount);
+#endif // EIGEN3_API
+				for (int j = 0; j < qCount; ++j)
+				{
+					IndexHeapSTL<Index, T>& heap(heaps[j]);
+					const T maxRadius(maxRadii[q0 + j]);
+					const T maxRadius2(maxRadius * maxRadius);
+					const T qNorm2(queryNorms2(j));
+					for (int i = 0; i < pCount; ++i)
+					{
+						// ||q-p||^2 = ||q||^2 + ||p||^2 - 2 q.p, can go slightly negative through cancellation
+						const T estDist(max(qNorm2 + cloudNorms2(p0 + i) - 2 * cross(i, j), T(0)));
+						// inflate the bounds by the cancellation error so no true candidate is missed
+						const T slack(T(8) * numeric_limits<T>::epsilon() * (qNorm2 + cloudNorms2(p0 + i)));
+						if ((estDist <= maxRadius2 + slack) &&
+							(estDist < heap.headValue() + slack))
+						{
+							// the norm trick loses precision, recompute candidates pairwise so
+							// the results match the unblocked scan
+							const T dist(dist2<T>(this->cloud.block(0, p0 + i, dim, 1), query.block(0, q0 + j, dim, 1)));
+							if ((dist <= maxRadius2) &&
+								(dist < heap.headValue()) &&
+								(allowSelfMatch || (dist > numeric_limits<T>::epsilon())))
+								heap.replaceHead(p0 + i, dist);
+						}
+					}
+				}
+			}
+			for (int j = 0; j < qCount; ++j)
+			{
+				if (sortResults)
+					heaps[j].sort();
+				heaps[j].getData(indices.col(q0 + j), dists2.col(q0 + j));
+			}
+		}
+		}
+
+		if (collectStatistics)
+			return (unsigned long)colCount * (unsigned long)cloudCount;
+		else
+			return 0;
+	}
+
 	template struct BruteForceSearch<float>;
 	template struct BruteForceSearch<double>;
+#ifdef EIGEN3_API
+	template struct BruteForceSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct BruteForceSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct BruteForceSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct BruteForceSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+#endif // EIGEN3_API
 }
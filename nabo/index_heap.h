@@ -100,6 +100,10 @@ namespace Nabo
 		/** \return the largest value in the heap */
 		inline const VT& headValue() const { return data.front().value; }
 		
+		//! get the number of neighbours the heap was sized for
+		/** \return the number of neighbours */
+		inline size_t size() const { return nbNeighbours; }
+		
 		//! put value into heap, replace the largest value if full
 		/** \param index new point index
 		 * 	\param value new distance value */
@@ -222,6 +226,10 @@ namespace Nabo
 		/** \return the smallest value in the heap */
 		inline const VT& headValue() const { return data[0].value; }
 		
+		//! get the number of neighbours the heap was sized for
+		/** \return the number of neighbours */
+		inline size_t size() const { return sizeMinusOne + 1; }
+		
 		//! replace the largest value of the heap
 		/** \param index new point index
 		 * 	\param value new distance value */
@@ -257,6 +265,161 @@ namespace Nabo
 	};
 #endif
 	
+	//! heap with fixed-capacity inline storage, falling back to a binary heap beyond its capacity
+	/** For sizes up to inlineCapacity, entries live in a struct-embedded, sentinel-terminated
+	 * 	array kept sorted by linear insertion, so that small-k queries neither allocate nor
+	 * 	branch on array bounds; for larger sizes, a binary heap as in IndexHeapSTL takes over. */
+	template<typename IT, typename VT>
+	struct IndexHeapAuto
+	{
+		//! type of an index
+		typedef IT Index;
+		//! type of a value
+		typedef VT Value;
+		
+		//! an entry of the heap
+		struct Entry
+		{
+			IT index; //!< index of point
+			VT value;  //!< distance for this point
+			
+			//! create an uninitialised entry, for the inline array
+			Entry() {}
+			//! create a new entry
+			Entry(const IT index, const VT value): index(index), value(value) {} 
+			//! return true if e0 is smaller than e1, false otherwise
+			friend bool operator<(const Entry& e0, const Entry& e1) { return e0.value < e1.value; }
+		};
+		//! vector of entry, type for the binary-heap storage
+		typedef std::vector<Entry> Entries;
+		//! vector of indices
+		typedef typename Eigen::Matrix<Index, Eigen::Dynamic, 1> IndexVector;
+		//! vector of values
+		typedef typename Eigen::Matrix<Value, Eigen::Dynamic, 1> ValueVector;
+		
+		//! largest size served by the inline storage
+		enum { inlineCapacity = 16 };
+		
+		//! inline storage: a -infinity sentinel followed by size entries in ascending order, largest last
+		Entry inlineData[inlineCapacity + 1];
+		//! binary-heap storage, only used when size exceeds inlineCapacity
+		Entries treeData;
+		//! number of neighbours requested
+		const size_t nbNeighbours;
+		//! whether the inline storage is active
+		const bool isInline;
+		
+		//! Constructor
+		/*! \param size number of elements in the heap */
+		IndexHeapAuto(const size_t size):
+			nbNeighbours(size),
+			isInline(size <= size_t(inlineCapacity))
+		{
+			inlineData[0] = Entry(0, -std::numeric_limits<VT>::infinity());
+			if (!isInline)
+				treeData.reserve(size);
+			reset();
+		}
+		
+		//! reset to the empty heap
+		inline void reset()
+		{
+			if (isInline)
+			{
+				for (size_t i = 1; i <= nbNeighbours; ++i)
+					inlineData[i] = Entry(0, std::numeric_limits<VT>::infinity());
+			}
+			else
+			{
+				treeData.clear();
+				treeData.push_back(Entry(0, std::numeric_limits<VT>::infinity()));
+			}
+		}
+		
+		//! get the largest value of the heap
+		/** \return the largest value in the heap */
+		inline const VT& headValue() const { return isInline ? inlineData[nbNeighbours].value : treeData.front().value; }
+		
+		//! get the number of neighbours the heap was sized for
+		/** \return the number of neighbours */
+		inline size_t size() const { return nbNeighbours; }
+		
+		//! put value into heap, replace the largest value if full
+		/** \param index new point index
+		 * 	\param value new distance value */
+		inline void replaceHead(const Index index, const Value value)
+		{
+			if (isInline)
+			{
+				// shift larger entries up over the old head; the sentinel stops the loop
+				size_t i(nbNeighbours);
+				while (inlineData[i - 1].value > value)
+				{
+					inlineData[i] = inlineData[i - 1];
+					--i;
+				}
+				inlineData[i].value = value;
+				inlineData[i].index = index;
+			}
+			else
+			{
+				if (treeData.size() == nbNeighbours)
+				{	// we have enough neighbours to discard largest
+					pop_heap(treeData.begin(), treeData.end());
+					treeData.back() = Entry(index, value);
+				}
+				else
+				{	// missing neighbours
+					treeData.push_back(Entry(index, value));
+				}
+				// ensure heap
+				push_heap(treeData.begin(), treeData.end());
+			}
+		}
+		
+		//! sort the entries, from the smallest to the largest
+		inline void sort()
+		{
+			// the inline storage is kept sorted by replaceHead
+			if (!isInline)
+				sort_heap(treeData.begin(), treeData.end());
+		}
+		
+		//! get the data from the heap
+		/** \param indices index vector
+		 * 	\param values value vector */
+		template<typename DI, typename DV>
+		inline void getData(const Eigen::MatrixBase<DI>& indices, const Eigen::MatrixBase<DV> & values) const
+		{
+			// note: we must implement this hack because of problem with reference to temporary
+			// C++0x will solve this with rvalue
+			// see: http://eigen.tuxfamily.org/dox-devel/TopicFunctionTakingEigenTypes.html
+			// for more informations
+			if (isInline)
+			{
+				for (size_t i = 0; i < nbNeighbours; ++i)
+				{
+					const_cast<Eigen::MatrixBase<DI>&>(indices).coeffRef(i) = inlineData[i + 1].index;
+					const_cast<Eigen::MatrixBase<DV>&>(values).coeffRef(i) = inlineData[i + 1].value;
+				}
+			}
+			else
+			{
+				size_t i = 0;
+				for (; i < treeData.size(); ++i)
+				{
+					const_cast<Eigen::MatrixBase<DI>&>(indices).coeffRef(i) = treeData[i].index;
+					const_cast<Eigen::MatrixBase<DV>&>(values).coeffRef(i) = treeData[i].value;
+				}
+				for (; i < nbNeighbours; ++i)
+				{
+					const_cast<Eigen::MatrixBase<DI>&>(indices).coeffRef(i) = 0;
+					const_cast<Eigen::MatrixBase<DV>&>(values).coeffRef(i) = std::numeric_limits<VT>::infinity();
+				}
+			}
+		}
+	};
+	
 	//! brute-force implementation of heap
 	/** It uses a vector and linear search, which provides replacement in O(n),
 	 * 	but with a very low constant overhead. */
@@ -315,6 +478,10 @@ namespace Nabo
 		//! get the largest value of the heap
 		/** \return the smallest value in the heap */
 		inline const VT& headValue() const { return headValueRef; }
+
+		//! get the number of neighbours the heap was sized for
+		/** \return the number of neighbours */
+		inline size_t size() const { return sizeMinusOne + 1; }
 		
 		//! replace the largest value of the heap
 		/** \param index new point index
@@ -32,6 +32,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "nabo_private.h"
 #include "index_heap.h"
 #include <iostream>
+#include <cmath>
+#include <fstream>
+#include <cstring>
 #include <stdexcept>
 #include <limits>
 #include <queue>
@@ -72,6 +75,77 @@ namespace Nabo
 		return 64;
 	}
 	
+	bool kdTreeNeedsLargeNodeIndices(const size_t pointCount, const unsigned dim, const unsigned bucketSize)
+	{
+		const uint32_t dimBitCount(getStorageBitCount<uint32_t>(dim));
+		const uint64_t maxNodeCount((0x1ULL << (32-dimBitCount)) - 1);
+		const uint64_t estimatedNodeCount(pointCount / max(bucketSize / 2, 1u));
+		return estimatedNodeCount > maxNodeCount;
+	}
+	
+	//! Return the current wall-clock time in seconds, for query timing statistics
+	inline double wallTime()
+	{
+#ifdef HAVE_OPENMP
+		return omp_get_wtime();
+#elif !defined(_WIN32)
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+#else
+		return 0;
+#endif
+	}
+
+	//! Return the square of a value
+	/** \param v value
+	 * \return v squared
+	 */
+	template<typename T>
+	inline T sqr(const T v)
+	{
+		return v * v;
+	}
+
+	//! Fill order with the query column indices sorted by Morton code
+	/** \param query query points, one per column
+	 * \param minBound lower bound of the quantization box
+	 * \param maxBound upper bound of the quantization box
+	 * \param dim dimensionality of the points
+	 * \param order return value, query column indices in spatially coherent order
+	 */
+	template<typename T>
+	void buildMortonOrder(const typename NearestNeighbourSearch<T>::Matrix& query, const typename NearestNeighbourSearch<T>::Vector& minBound, const typename NearestNeighbourSearch<T>::Vector& maxBound, const int dim, std::vector<int>& order)
+	{
+		const int colCount(query.cols());
+		const unsigned bitsPerDim(min(unsigned(16), unsigned(63) / unsigned(dim)));
+		const uint64_t maxCell((uint64_t(1) << bitsPerDim) - 1);
+		typedef pair<uint64_t, int> KeyedIndex;
+		vector<KeyedIndex> keys;
+		keys.reserve(colCount);
+		for (int i = 0; i < colCount; ++i)
+		{
+			uint64_t key(0);
+			for (unsigned b = 0; b < bitsPerDim; ++b)
+			{
+				const unsigned shift(bitsPerDim - 1 - b);
+				for (int d = 0; d < dim; ++d)
+				{
+					const T extent(maxBound(d) - minBound(d));
+					T ratio(extent > 0 ? (query.coeff(d, i) - minBound(d)) / extent : T(0));
+					ratio = min(max(ratio, T(0)), T(1));
+					const uint64_t cell(uint64_t(ratio * T(maxCell)));
+					key = (key << 1) | ((cell >> shift) & 1);
+				}
+			}
+			keys.push_back(KeyedIndex(key, i));
+		}
+		sort(keys.begin(), keys.end());
+		order.resize(colCount);
+		for (int i = 0; i < colCount; ++i)
+			order[i] = keys[i].second;
+	}
+
 	//! Return the index of the maximum value of a vector of positive values
 	/** \param v vector of positive values
 	 * \return index of maximum value, 0 if the vector is empty
@@ -92,9 +166,22 @@ namespace Nabo
 		return maxIdx;
 	}
 	
+	//! Mapping from heap type to the search type recorded in tree dumps
+	template<typename Heap>
+	struct SearchTypeOfHeap {};
+	//! \copydoc SearchTypeOfHeap
+	template<typename IT, typename VT>
+	struct SearchTypeOfHeap<IndexHeapSTL<IT, VT> > { enum { value = NearestNeighbourSearch<VT>::KDTREE_TREE_HEAP }; };
+	//! \copydoc SearchTypeOfHeap
+	template<typename IT, typename VT>
+	struct SearchTypeOfHeap<IndexHeapBruteForceVector<IT, VT> > { enum { value = NearestNeighbourSearch<VT>::KDTREE_LINEAR_HEAP }; };
+	//! \copydoc SearchTypeOfHeap
+	template<typename IT, typename VT>
+	struct SearchTypeOfHeap<IndexHeapAuto<IT, VT> > { enum { value = NearestNeighbourSearch<VT>::KDTREE_LINEAR_HEAP }; };
+
 	// OPT
-	template<typename T, typename Heap>
-	pair<T,T> KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::getBounds(const BuildPointsIt first, const BuildPointsIt last, const unsigned dim)
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	pair<T,T> KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::getBounds(const BuildPointsIt first, const BuildPointsIt last, const unsigned dim)
 	{
 		T minVal(boost::numeric::bounds<T>::highest());
 		T maxVal(boost::numeric::bounds<T>::lowest());
@@ -109,39 +196,19 @@ namespace Nabo
 		return make_pair(minVal, maxVal);
 	}
 	
-	template<typename T, typename Heap>
-	unsigned KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::buildNodes(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues)
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	int KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::splitPoints(const BuildPointsIt first, const BuildPointsIt last, const Vector& minValues, const Vector& maxValues, unsigned& cutDim, T& cutVal)
 	{
 		const int count(last - first);
-		assert(count >= 1);
-		const unsigned pos(nodes.size());
-		
-		//cerr << count << endl;
-		if (count <= int(bucketSize))
-		{
-			const uint32_t initBucketsSize(buckets.size());
-			//cerr << "creating bucket with " << count << " values" << endl;
-			for (int i = 0; i < count; ++i)
-			{
-				const Index index(*(first+i));
-				assert(index < cloud.cols());
-				buckets.push_back(BucketEntry(&cloud.coeff(0, index), index));
-				//cerr << "  " << &cloud.coeff(0, index) << ", " << index << endl;
-			}
-			//cerr << "at address " << bucketStart << endl;
-			nodes.push_back(Node(createDimChildBucketSize(dim, count),initBucketsSize));
-			return pos;
-		}
-		
+
 		// find the largest dimension of the box
-		const unsigned cutDim = argMax<T>(maxValues - minValues);
+		cutDim = argMax<T>(maxValues - minValues);
 		const T idealCutVal((maxValues(cutDim) + minValues(cutDim))/2);
 		
 		// get bounds from actual points
 		const pair<T,T> minMaxVals(getBounds(first, last, cutDim));
-		
+
 		// correct cut following bounds
-		T cutVal;
 		if (idealCutVal < minMaxVals.first)
 			cutVal = minMaxVals.first;
 		else if (idealCutVal > minMaxVals.second)
@@ -206,54 +273,195 @@ namespace Nabo
 			cerr << "minMaxVals.second: " << minMaxVals.second << endl;
 		}*/
 		assert(leftCount < count);
-		
+
+		return leftCount;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	size_t KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::buildNodes(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues, Nodes& intoNodes, Buckets& intoBuckets)
+	{
+		const int count(last - first);
+		assert(count >= 1);
+		const size_t pos(intoNodes.size());
+
+		//cerr << count << endl;
+		if (count <= int(bucketSize))
+		{
+			const size_t initBucketsSize(intoBuckets.size());
+			//cerr << "creating bucket with " << count << " values" << endl;
+			for (int i = 0; i < count; ++i)
+			{
+				const Index index(*(first+i));
+				assert(index < cloud.cols());
+				intoBuckets.push_back(BucketEntry(&cloud.coeff(0, index), index));
+				//cerr << "  " << &cloud.coeff(0, index) << ", " << index << endl;
+			}
+			//cerr << "at address " << bucketStart << endl;
+			intoNodes.push_back(Node(createDimChildBucketSize(dim, count),initBucketsSize));
+			return pos;
+		}
+
+		// find the cut and partition the points around it
+		unsigned cutDim;
+		T cutVal;
+		const int leftCount(splitPoints(first, last, minValues, maxValues, cutDim, cutVal));
+
 		// update bounds for left
 		Vector leftMaxValues(maxValues);
 		leftMaxValues[cutDim] = cutVal;
 		// update bounds for right
 		Vector rightMinValues(minValues);
 		rightMinValues[cutDim] = cutVal;
-		
+
 		// add this
-		nodes.push_back(Node(0, cutVal));
-		
+		intoNodes.push_back(Node(0, cutVal));
+
 		// recurse
-		const unsigned _UNUSED leftChild = buildNodes(first, first + leftCount, minValues, leftMaxValues);
+		const size_t _UNUSED leftChild = buildNodes(first, first + leftCount, minValues, leftMaxValues, intoNodes, intoBuckets);
 		assert(leftChild == pos + 1);
-		const unsigned rightChild = buildNodes(first + leftCount, last, rightMinValues, maxValues);
-		
+		const size_t rightChild = buildNodes(first + leftCount, last, rightMinValues, maxValues, intoNodes, intoBuckets);
+
+		// write right child index and return
+		intoNodes[pos].dimChildBucketSize = createDimChildBucketSize(cutDim, rightChild);
+		return pos;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	size_t KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::buildNodesParallel(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues, Nodes& intoNodes, Buckets& intoBuckets, const int parallelDepth)
+	{
+		const int count(last - first);
+		assert(count >= 1);
+		const size_t pos(intoNodes.size());
+
+		// stop spawning tasks, build the subtree serially
+		if (parallelDepth <= 0 || count <= int(bucketSize))
+			return buildNodes(first, last, minValues, maxValues, intoNodes, intoBuckets);
+
+		// find the cut and partition the points around it
+		unsigned cutDim;
+		T cutVal;
+		const int leftCount(splitPoints(first, last, minValues, maxValues, cutDim, cutVal));
+
+		// update bounds for left
+		Vector leftMaxValues(maxValues);
+		leftMaxValues[cutDim] = cutVal;
+		// update bounds for right
+		Vector rightMinValues(minValues);
+		rightMinValues[cutDim] = cutVal;
+
+		// add this
+		intoNodes.push_back(Node(0, cutVal));
+
+		// build the right subtree in a task of its own, into private vectors;
+		// the left subtree fills intoNodes directly, keeping the left child at pos + 1
+		Nodes rightNodes;
+		Buckets rightBuckets;
+		#pragma omp task default(shared)
+		buildNodesParallel(first + leftCount, last, rightMinValues, maxValues, rightNodes, rightBuckets, parallelDepth - 1);
+		const size_t _UNUSED leftChild = buildNodesParallel(first, first + leftCount, minValues, leftMaxValues, intoNodes, intoBuckets, parallelDepth - 1);
+		assert(leftChild == pos + 1);
+		#pragma omp taskwait
+
+		// stitch the right subtree after the left one, offsetting its indices
+		const size_t rightChild(intoNodes.size());
+		const size_t bucketOffset(intoBuckets.size());
+		for (typename Nodes::const_iterator it(rightNodes.begin()); it != rightNodes.end(); ++it)
+		{
+			Node node(*it);
+			if (getDim(node.dimChildBucketSize) == uint32_t(dim))
+				node.bucketIndex += bucketOffset;
+			else
+				node.dimChildBucketSize = createDimChildBucketSize(getDim(node.dimChildBucketSize), getChildBucketSize(node.dimChildBucketSize) + rightChild);
+			intoNodes.push_back(node);
+		}
+		intoBuckets.insert(intoBuckets.end(), rightBuckets.begin(), rightBuckets.end());
+
 		// write right child index and return
-		nodes[pos].dimChildBucketSize = createDimChildBucketSize(cutDim, rightChild);
+		intoNodes[pos].dimChildBucketSize = createDimChildBucketSize(cutDim, rightChild);
 		return pos;
 	}
 
-	template<typename T, typename Heap>
-	KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters):
-		NearestNeighbourSearch<T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags),
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters):
+		NearestNeighbourSearch<T, Cloud_T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags),
 		bucketSize(additionalParameters.get<unsigned>("bucketSize", 8)),
+		buildParallelism(additionalParameters.get<unsigned>("buildParallelism", 1)),
+		maxThreads(additionalParameters.get<unsigned>("maxThreads", 0)),
+		maxLeafVisited(additionalParameters.get<unsigned>("maxLeafVisited", 0)),
+		soaBuckets(additionalParameters.get<unsigned>("soaBuckets", 0) != 0),
+		quantizedBuckets(additionalParameters.get<unsigned>("quantizedBuckets", 0) != 0),
+		nodeLayout(additionalParameters.get<unsigned>("nodeLayout", 0)),
 		dimBitCount(getStorageBitCount<uint32_t>(this->dim)),
-		dimMask((1<<dimBitCount)-1)
+		dimMask((PackedIndexT(1)<<dimBitCount)-1)
 	{
 		if (bucketSize < 2)
 			throw runtime_error((boost::format("Requested bucket size %1%, but must be larger than 2") % bucketSize).str());
+		if (soaBuckets && bucketSize > maxSoABucketSize)
+			throw runtime_error((boost::format("Requested bucket size %1%, but must be at most %2% when soaBuckets is set") % bucketSize % maxSoABucketSize).str());
+		if (quantizedBuckets && bucketSize > maxSoABucketSize)
+			throw runtime_error((boost::format("Requested bucket size %1%, but must be at most %2% when quantizedBuckets is set") % bucketSize % maxSoABucketSize).str());
+		buildTree();
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::rebuild()
+	{
+		if (cloud.cols() == 0)
+			throw runtime_error("Cloud has no points");
+		buildTree();
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::rebindCloud()
+	{
+		for (typename Buckets::iterator it(buckets.begin()); it != buckets.end(); ++it)
+			it->pt = &cloud.coeff(0, it->index);
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::buildTree()
+	{
+		// clear() keeps the capacity of the vectors, so that rebuilding over a cloud of
+		// similar size does not allocate once the steady-state capacity is reached
+		nodes.clear();
+		buckets.clear();
+		const_cast<Vector&>(minBound) = Vector::Constant(dim, numeric_limits<T>::max());
+		const_cast<Vector&>(maxBound) = Vector::Constant(dim, numeric_limits<T>::min());
+
 		if (cloud.cols() <= bucketSize)
 		{
 			// make a single-bucket tree
 			for (int i = 0; i < cloud.cols(); ++i)
+			{
 				buckets.push_back(BucketEntry(&cloud.coeff(0, i), i));
-			nodes.push_back(Node(createDimChildBucketSize(this->dim, cloud.cols()),uint32_t(0)));
+				if (quantizedBuckets)
+				{
+					// the quantization grid needs the bounds, which the tree build computes otherwise
+					const Vector& v(cloud.block(0,i,this->dim,1));
+#ifdef EIGEN3_API
+					const_cast<Vector&>(minBound) = minBound.array().min(v.array());
+					const_cast<Vector&>(maxBound) = maxBound.array().max(v.array());
+#else // EIGEN3_API
+					const_cast<Vector&>(minBound) = minBound.cwise().min(v);
+					const_cast<Vector&>(maxBound) = maxBound.cwise().max(v);
+#endif // EIGEN3_API
+				}
+			}
+			nodes.push_back(Node(createDimChildBucketSize(this->dim, cloud.cols()),size_t(0)));
+			buildSoABuckets();
+			buildQuantizedBuckets();
 			return;
 		}
 		
-		const uint64_t maxNodeCount((0x1ULL << (32-dimBitCount)) - 1);
+		const uint64_t maxNodeCount(uint64_t(PackedIndexT(-1)) >> dimBitCount);
 		const uint64_t estimatedNodeCount(cloud.cols() / (bucketSize / 2));
 		if (estimatedNodeCount > maxNodeCount)
 		{
-			throw runtime_error((boost::format("Cloud has a risk to have more nodes (%1%) than the kd-tree allows (%2%). The kd-tree has %3% bits for dimensions and %4% bits for node indices") % estimatedNodeCount % maxNodeCount % dimBitCount % (32-dimBitCount)).str());
+			throw runtime_error((boost::format("Cloud has a risk to have more nodes (%1%) than the kd-tree allows (%2%). The kd-tree has %3% bits for dimensions and %4% bits for node indices") % estimatedNodeCount % maxNodeCount % dimBitCount % (sizeof(PackedIndexT)*8-dimBitCount)).str());
 		}
 		
 		// build point vector and compute bounds
-		BuildPoints buildPoints;
+		buildPoints.clear();
 		buildPoints.reserve(cloud.cols());
 		for (int i = 0; i < cloud.cols(); ++i)
 		{
@@ -269,28 +477,230 @@ namespace Nabo
 		}
 		
 		// create nodes
-		buildNodes(buildPoints.begin(), buildPoints.end(), minBound, maxBound);
+#ifdef HAVE_OPENMP
+		const unsigned threadCount(buildParallelism != 0 ? buildParallelism : unsigned(omp_get_max_threads()));
+		if (threadCount > 1)
+		{
+			// spawn subtree tasks for a few levels more than needed to cover
+			// all threads, to balance the load of uneven subtrees
+			const int parallelDepth(getStorageBitCount<uint32_t>(threadCount - 1) + 2);
+			#pragma omp parallel num_threads(threadCount)
+			#pragma omp single
+			buildNodesParallel(buildPoints.begin(), buildPoints.end(), minBound, maxBound, nodes, buckets, parallelDepth);
+		}
+		else
+#endif // HAVE_OPENMP
+		buildNodes(buildPoints.begin(), buildPoints.end(), minBound, maxBound, nodes, buckets);
 		buildPoints.clear();
+
+		if (nodeLayout == 1)
+			relayoutNodes();
+
+		buildSoABuckets();
+		buildQuantizedBuckets();
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::relayoutNodes()
+	{
+		// The search expects the left child right after its parent, so the only freedom
+		// is where each right subtree starts; depth-first construction pushes it behind the
+		// whole left subtree, megabytes away near the root of a large tree. Reorder the
+		// nodes by emitting left spines of subtrees in breadth order instead, which packs
+		// the upper levels of the tree, hot on every query, into a few cache lines.
+		const size_t nodeCount(nodes.size());
+		Nodes newNodes;
+		newNodes.reserve(nodeCount);
+		std::vector<size_t> newIndex(nodeCount);
+		queue<size_t> pending;
+		pending.push(0);
+		while (!pending.empty())
+		{
+			size_t n(pending.front());
+			pending.pop();
+			// emit the left spine of the subtree rooted at n
+			while (1)
+			{
+				newIndex[n] = newNodes.size();
+				newNodes.push_back(nodes[n]);
+				if (getDim(nodes[n].dimChildBucketSize) == uint32_t(dim))
+					break;
+				pending.push(getChildBucketSize(nodes[n].dimChildBucketSize));
+				n = n + 1;
+			}
+		}
+		assert(newNodes.size() == nodeCount);
+		// rewrite the right-child indices of split nodes
+		for (typename Nodes::iterator it(newNodes.begin()); it != newNodes.end(); ++it)
+		{
+			const uint32_t cd(getDim(it->dimChildBucketSize));
+			if (cd != uint32_t(dim))
+				it->dimChildBucketSize = createDimChildBucketSize(cd, newIndex[getChildBucketSize(it->dimChildBucketSize)]);
+		}
+		nodes.swap(newNodes);
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::buildSoABuckets()
+	{
+		if (!soaBuckets)
+			return;
+		bucketCoords.resize(buckets.size() * dim);
+		for (typename Nodes::const_iterator it(nodes.begin()); it != nodes.end(); ++it)
+		{
+			if (getDim(it->dimChildBucketSize) != uint32_t(dim))
+				continue;
+			const size_t bucketIndex(it->bucketIndex);
+			const size_t count(getChildBucketSize(it->dimChildBucketSize));
+			T* block(&bucketCoords[size_t(bucketIndex) * dim]);
+			for (int d = 0; d < dim; ++d)
+				for (size_t i = 0; i < count; ++i)
+					block[d * count + i] = buckets[bucketIndex + i].pt[d];
+		}
 	}
 	
-	template<typename T, typename Heap>
-	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::buildQuantizedBuckets()
+	{
+		if (!quantizedBuckets)
+			return;
+		// one quantization step per dimension, relative to the bounding box of the cloud
+		quantStep.resize(dim);
+		T halfDiagonal2(0);
+		for (int d = 0; d < dim; ++d)
+		{
+			const T extent(maxBound(d) - minBound(d));
+			quantStep[d] = extent / T(65535);
+			halfDiagonal2 += (quantStep[d]/2) * (quantStep[d]/2);
+		}
+		// inflate slightly so that float rounding cannot make the bound miss a true neighbour
+		quantHalfDiagonal = sqrt(halfDiagonal2) * (T(1) + T(32) * numeric_limits<T>::epsilon());
+		quantizedCoords.resize(buckets.size() * dim);
+		for (typename Nodes::const_iterator it(nodes.begin()); it != nodes.end(); ++it)
+		{
+			if (getDim(it->dimChildBucketSize) != uint32_t(dim))
+				continue;
+			const size_t bucketIndex(it->bucketIndex);
+			const size_t count(getChildBucketSize(it->dimChildBucketSize));
+			uint16_t* block(&quantizedCoords[size_t(bucketIndex) * dim]);
+			for (int d = 0; d < dim; ++d)
+				for (size_t i = 0; i < count; ++i)
+				{
+					const T step(quantStep[d]);
+					if (step > 0)
+						block[d * count + i] = uint16_t(floor((buckets[bucketIndex + i].pt[d] - minBound(d)) / step + T(0.5)));
+					else
+						block[d * count + i] = 0;
+				}
+		}
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const CloudType& cloud, const unsigned creationOptionFlags, const KDTreeFileHeader& fileHeader, std::istream& stream):
+		NearestNeighbourSearch<T, Cloud_T>::NearestNeighbourSearch(cloud, fileHeader.dim, creationOptionFlags),
+		bucketSize(fileHeader.bucketSize),
+		buildParallelism(1),
+		maxThreads(0),
+		maxLeafVisited(0),
+		soaBuckets(false),
+		quantizedBuckets(false),
+		nodeLayout(0),
+		dimBitCount(fileHeader.dimBitCount),
+		dimMask((PackedIndexT(1)<<dimBitCount)-1)
+	{
+		if (fileHeader.dim != uint32_t(this->dim))
+			throw runtime_error((boost::format("Tree dump was saved with %1% dimensions, but the given cloud has %2%") % fileHeader.dim % this->dim).str());
+
+		stream.read(reinterpret_cast<char*>(&const_cast<Vector&>(minBound).coeffRef(0)), dim * sizeof(T));
+		stream.read(reinterpret_cast<char*>(&const_cast<Vector&>(maxBound).coeffRef(0)), dim * sizeof(T));
+		nodes.resize(fileHeader.nodeCount);
+		stream.read(reinterpret_cast<char*>(&nodes[0]), nodes.size() * sizeof(Node));
+		// bucket entries only store point indices on disk, recompute their point pointers into the given cloud
+		buckets.reserve(fileHeader.bucketCount);
+		for (uint64_t i = 0; i < fileHeader.bucketCount; ++i)
+		{
+			Index index;
+			stream.read(reinterpret_cast<char*>(&index), sizeof(index));
+			if (index < 0 || index >= cloud.cols())
+				throw runtime_error((boost::format("Tree dump contains point index %1% out of range [0:%2%[") % index % cloud.cols()).str());
+			buckets.push_back(BucketEntry(&cloud.coeff(0, index), index));
+		}
+		if (!stream.good())
+			throw runtime_error("Unexpected end of stream while reading tree dump");
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::save(const std::string& fileName) const
+	{
+		ofstream ofs(fileName.c_str(), ios::binary);
+		if (!ofs.good())
+			throw runtime_error((boost::format("Cannot open file %1% for writing") % fileName).str());
+
+		KDTreeFileHeader fileHeader;
+		memcpy(fileHeader.magic, "NABOTREE", 8);
+		fileHeader.version = (sizeof(PackedIndexT) == 8) ? 2 : 1;
+		fileHeader.scalarSize = sizeof(T);
+		fileHeader.searchType = SearchTypeOfHeap<Heap>::value;
+		fileHeader.dim = dim;
+		fileHeader.bucketSize = bucketSize;
+		fileHeader.dimBitCount = dimBitCount;
+		fileHeader.pointCount = cloud.cols();
+		fileHeader.nodeCount = nodes.size();
+		fileHeader.bucketCount = buckets.size();
+		ofs.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+		ofs.write(reinterpret_cast<const char*>(&minBound.coeff(0)), dim * sizeof(T));
+		ofs.write(reinterpret_cast<const char*>(&maxBound.coeff(0)), dim * sizeof(T));
+		ofs.write(reinterpret_cast<const char*>(&nodes[0]), nodes.size() * sizeof(Node));
+		// bucket entries hold pointers into the cloud, only their point indices are meaningful on disk
+		for (typename Buckets::const_iterator it(buckets.begin()); it != buckets.end(); ++it)
+		{
+			const Index index(it->index);
+			ofs.write(reinterpret_cast<const char*>(&index), sizeof(index));
+		}
+		if (!ofs.good())
+			throw runtime_error((boost::format("Error while writing tree dump to file %1%") % fileName).str());
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	typename NearestNeighbourSearch<T, Cloud_T>::IndexVector KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::getLeafOrder() const
+	{
+		// buckets are filled leaf by leaf in the depth-first order of the build, so their
+		// entry indices already are the leaf order of the cloud points
+		IndexVector order(buckets.size());
+		for (size_t i = 0; i < buckets.size(); ++i)
+			order[i] = buckets[i].index;
+		return order;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
 		checkSizesKnn(query, indices, dists2, k, optionFlags);
 		
-		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
-		const bool sortResults(optionFlags & NearestNeighbourSearch<T>::SORT_RESULTS);
-		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool reorderQueries(optionFlags & NearestNeighbourSearch<T, Cloud_T>::REORDER_QUERIES);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
 		const T maxRadius2(maxRadius * maxRadius);
 		const T maxError2((1+epsilon)*(1+epsilon));
 		const int colCount(query.cols());
 		
 		assert(nodes.size() > 0);
 
-		IndexMatrix result(k, query.cols());
+		if (collectStatistics)
+			queryStatistics.assign(colCount, QueryStatistics());
+		else
+			queryStatistics.clear();
+
+		// process queries in Morton order so that consecutive iterations hit nearby tree regions;
+		// results land in the caller's columns directly, as onePointKnn writes the column it is given
+		std::vector<int> order;
+		if (reorderQueries)
+			buildMortonOrder<T>(query, minBound, maxBound, dim, order);
+
 		unsigned long leafTouchedCount(0);
 
-#pragma omp parallel 
+#pragma omp parallel num_threads(maxThreads != 0 ? int(maxThreads) : omp_get_max_threads())
 		{		
 
 		Heap heap(k);
@@ -299,28 +709,39 @@ namespace Nabo
 #pragma omp for reduction(+:leafTouchedCount) schedule(guided,32)
 		for (int i = 0; i < colCount; ++i)
 		{
-			leafTouchedCount += onePointKnn(query, indices, dists2, i, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults);
+			const int c(reorderQueries ? order[i] : i);
+			leafTouchedCount += onePointKnn(query, indices, dists2, c, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults);
 		}
 		}
 		return leafTouchedCount;
 	}
 	
-	template<typename T, typename Heap>
-	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
 	{
 		checkSizesKnn(query, indices, dists2, k, optionFlags, &maxRadii);
 		
-		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
-		const bool sortResults(optionFlags & NearestNeighbourSearch<T>::SORT_RESULTS);
-		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool reorderQueries(optionFlags & NearestNeighbourSearch<T, Cloud_T>::REORDER_QUERIES);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
 		const T maxError2((1+epsilon)*(1+epsilon));
 		const int colCount(query.cols());
 		
 		assert(nodes.size() > 0);
-		IndexMatrix result(k, query.cols());
+
+		if (collectStatistics)
+			queryStatistics.assign(colCount, QueryStatistics());
+		else
+			queryStatistics.clear();
+
+		std::vector<int> order;
+		if (reorderQueries)
+			buildMortonOrder<T>(query, minBound, maxBound, dim, order);
+
 		unsigned long leafTouchedCount(0);
 
-#pragma omp parallel 
+#pragma omp parallel num_threads(maxThreads != 0 ? int(maxThreads) : omp_get_max_threads())
 		{		
 
 		Heap heap(k);
@@ -329,118 +750,703 @@ namespace Nabo
 #pragma omp for reduction(+:leafTouchedCount) schedule(guided,32)
 		for (int i = 0; i < colCount; ++i)
 		{
-			const T maxRadius(maxRadii[i]);
+			const int c(reorderQueries ? order[i] : i);
+			const T maxRadius(maxRadii[c]);
 			const T maxRadius2(maxRadius * maxRadius);
-			leafTouchedCount += onePointKnn(query, indices, dists2, i, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults);
+			leafTouchedCount += onePointKnn(query, indices, dists2, c, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults);
 		}
 		}
 		return leafTouchedCount;
 	}
 	
-	template<typename T, typename Heap>
-	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::onePointKnn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, int i, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults) const
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::knn(const Matrix& query, typename NearestNeighbourSearch<T, Cloud_T>::ResultSink& sink, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
-		fill(off.begin(), off.end(), 0);
-		heap.reset();
-		unsigned long leafTouchedCount(0);
-		
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool reorderQueries(optionFlags & NearestNeighbourSearch<T, Cloud_T>::REORDER_QUERIES);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
+		const T maxRadius2(maxRadius * maxRadius);
+		const T maxError2((1+epsilon)*(1+epsilon));
+		const int colCount(query.cols());
+
+		// checks of checkSizesKnn, without the result matrices
 		if (allowSelfMatch)
 		{
-			if (collectStatistics)
-				leafTouchedCount += recurseKnn<true, true>(&query.coeff(0, i), 0, 0, heap, off, maxError2, maxRadius2);
-			else
-				recurseKnn<true, false>(&query.coeff(0, i), 0, 0, heap, off, maxError2, maxRadius2);
+			if (k > cloud.cols())
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud (%2%)") % k % cloud.cols()).str());
 		}
 		else
 		{
-			if (collectStatistics)
-				leafTouchedCount += recurseKnn<false, true>(&query.coeff(0, i), 0, 0, heap, off, maxError2, maxRadius2);
-			else
-				recurseKnn<false, false>(&query.coeff(0, i), 0, 0, heap, off, maxError2, maxRadius2);
+			if (k > cloud.cols()-1)
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud minus 1 (%2%) (as self match is forbidden)") % k % (cloud.cols()-1)).str());
+		}
+		if (query.rows() < dim)
+			throw runtime_error((boost::format("Query has less dimensions (%1%) than requested for cloud (%2%)") % query.rows() % dim).str());
+
+		assert(nodes.size() > 0);
+
+		if (collectStatistics)
+			queryStatistics.assign(colCount, QueryStatistics());
+		else
+			queryStatistics.clear();
+
+		std::vector<int> order;
+		if (reorderQueries)
+			buildMortonOrder<T>(query, minBound, maxBound, dim, order);
+
+		unsigned long leafTouchedCount(0);
+
+#pragma omp parallel num_threads(maxThreads != 0 ? int(maxThreads) : omp_get_max_threads())
+		{
+
+		Heap heap(k);
+		std::vector<T> off(dim, 0);
+		IndexVector indices(k);
+		Vector dists2(k);
+
+#pragma omp for reduction(+:leafTouchedCount) schedule(guided,32)
+		for (int i = 0; i < colCount; ++i)
+		{
+			const int c(reorderQueries ? order[i] : i);
+			QueryStatistics dummyStats;
+			QueryStatistics& stats(collectStatistics ? queryStatistics[c] : dummyStats);
+			leafTouchedCount += onePointKnn(&query.coeff(0, c), heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+			heap.getData(indices, dists2);
+			sink.onQueryDone(c, k, &indices.coeffRef(0), &dists2.coeffRef(0));
+		}
 		}
-		
-		if (sortResults)
-			heap.sort();
-		
-		heap.getData(indices.col(i), dists2.col(i));
 		return leafTouchedCount;
 	}
-	
-	template<typename T, typename Heap> template<bool allowSelfMatch, bool collectStatistics>
-	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap>::recurseKnn(const T* query, const unsigned n, T rd, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2) const
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::selfKnn(IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
-		const Node& node(nodes[n]);
-		const uint32_t cd(getDim(node.dimChildBucketSize));
-		
-		if (cd == uint32_t(dim))
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
+		const T maxRadius2(maxRadius * maxRadius);
+		const T maxError2((1+epsilon)*(1+epsilon));
+		const int colCount(cloud.cols());
+		const int dimCount(dim);
+
+		// checks of checkSizesKnn, with the cloud as its own query matrix
+		if (allowSelfMatch)
 		{
-			//cerr << "entering bucket " << node.bucket << endl;
-			const BucketEntry* bucket(&buckets[node.bucketIndex]);
-			const uint32_t bucketSize(getChildBucketSize(node.dimChildBucketSize));
-			for (uint32_t i = 0; i < bucketSize; ++i)
-			{
-				//cerr << "  " << bucket-> pt << endl;
-				//const T dist(dist2<T>(query, cloud.col(index)));
-				//const T dist((query - cloud.col(index)).squaredNorm());
-				T dist(0);
-				const T* qPtr(query);
-				const T* dPtr(bucket->pt);
-				for (int i = 0; i < this->dim; ++i)
-				{
-					const T diff(*qPtr - *dPtr);
-					dist += diff*diff;
-					qPtr++; dPtr++;
-				}
-				if ((dist <= maxRadius2) &&
-					(dist < heap.headValue()) &&
-					(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
-				)
-					heap.replaceHead(bucket->index, dist);
-				++bucket;
-			}
-			return (unsigned long)(bucketSize);
+			if (k > cloud.cols())
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud (%2%)") % k % cloud.cols()).str());
 		}
 		else
 		{
-			const unsigned rightChild(getChildBucketSize(node.dimChildBucketSize));
-			unsigned long leafVisitedCount(0);
-			T& offcd(off[cd]);
-			//const T old_off(off.coeff(cd));
-			const T old_off(offcd);
-			const T new_off(query[cd] - node.cutVal);
-			if (new_off > 0)
-			{
-				if (collectStatistics)
-					leafVisitedCount += recurseKnn<allowSelfMatch, true>(query, rightChild, rd, heap, off, maxError2, maxRadius2);
-				else
-					recurseKnn<allowSelfMatch, false>(query, rightChild, rd, heap, off, maxError2, maxRadius2);
-				rd += - old_off*old_off + new_off*new_off;
-				if ((rd <= maxRadius2) &&
+			if (k > cloud.cols()-1)
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud minus 1 (%2%) (as self match is forbidden)") % k % (cloud.cols()-1)).str());
+		}
+		if (indices.rows() != k)
+			throw runtime_error((boost::format("Index matrix has a different number of rows (%1%) than k (%2%)") % indices.rows() % k).str());
+		if (indices.cols() != colCount)
+			throw runtime_error((boost::format("Index matrix has a different number of columns (%1%) than cloud points (%2%)") % indices.cols() % colCount).str());
+		if (dists2.rows() != k)
+			throw runtime_error((boost::format("Distance matrix has a different number of rows (%1%) than k (%2%)") % dists2.rows() % k).str());
+		if (dists2.cols() != colCount)
+			throw runtime_error((boost::format("Distance matrix has a different number of columns (%1%) than cloud points (%2%)") % dists2.cols() % colCount).str());
+
+		assert(nodes.size() > 0);
+
+		if (collectStatistics)
+			queryStatistics.assign(colCount, QueryStatistics());
+		else
+			queryStatistics.clear();
+
+		// gather the leaves once, so that the parallel loop can hand out whole buckets
+		std::vector<size_t> leafNodes;
+		for (size_t n = 0; n < nodes.size(); ++n)
+			if (getDim(nodes[n].dimChildBucketSize) == uint32_t(dim))
+				leafNodes.push_back(n);
+
+		unsigned long leafTouchedCount(0);
+
+#pragma omp parallel num_threads(maxThreads != 0 ? int(maxThreads) : omp_get_max_threads())
+		{
+
+		Heap heap(k);
+		std::vector<T> off(dim, 0);
+
+#pragma omp for reduction(+:leafTouchedCount) schedule(guided,4)
+		for (int li = 0; li < int(leafNodes.size()); ++li)
+		{
+			const Node& leaf(nodes[leafNodes[li]]);
+			const size_t bucketStart(leaf.bucketIndex);
+			const size_t bucketSize(getChildBucketSize(leaf.dimChildBucketSize));
+			for (size_t bi = 0; bi < bucketSize; ++bi)
+			{
+				const T* query(buckets[bucketStart + bi].pt);
+				const Index queryIndex(buckets[bucketStart + bi].index);
+				// warm radius bound: the k-th smallest distance to the bucket mates; the true
+				// k nearest neighbours cannot be farther, so it prunes the descent from the root
+				heap.reset();
+				for (size_t bj = 0; bj < bucketSize; ++bj)
+				{
+					T dist(0);
+					const T* qPtr(query);
+					const T* dPtr(buckets[bucketStart + bj].pt);
+					for (int d = 0; d < dimCount; ++d)
+					{
+						const T diff(*qPtr - *dPtr);
+						dist += diff*diff;
+						qPtr++; dPtr++;
+					}
+					if ((dist < heap.headValue()) &&
+						(allowSelfMatch || (dist > numeric_limits<T>::epsilon())))
+						heap.replaceHead(buckets[bucketStart + bj].index, dist);
+				}
+				const T warmRadius2(min(maxRadius2, heap.headValue()));
+
+				QueryStatistics dummyStats;
+				QueryStatistics& stats(collectStatistics ? queryStatistics[queryIndex] : dummyStats);
+				leafTouchedCount += onePointKnn(query, heap, off, maxError2, warmRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+				heap.getData(indices.col(queryIndex), dists2.col(queryIndex));
+			}
+		}
+		}
+		return leafTouchedCount;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::onePointKnn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, int i, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults) const
+	{
+		QueryStatistics dummyStats;
+		QueryStatistics& stats(collectStatistics ? queryStatistics[i] : dummyStats);
+		const unsigned long leafTouchedCount(onePointKnn(&query.coeff(0, i), heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats));
+		heap.getData(indices.col(i), dists2.col(i));
+		return leafTouchedCount;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::onePointKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults, QueryStatistics& stats) const
+	{
+		if (maxLeafVisited != 0)
+		{
+			fill(off.begin(), off.end(), 0);
+			heap.reset();
+			const double startTime(collectStatistics ? wallTime() : 0);
+			unsigned long leafTouchedCount(0);
+			if (allowSelfMatch)
+				leafTouchedCount = bestBinFirstKnn<true>(query, heap, off, maxError2, maxRadius2, collectStatistics, stats);
+			else
+				leafTouchedCount = bestBinFirstKnn<false>(query, heap, off, maxError2, maxRadius2, collectStatistics, stats);
+			if (collectStatistics)
+				stats.seconds = wallTime() - startTime;
+			if (sortResults)
+				heap.sort();
+			return collectStatistics ? leafTouchedCount : 0;
+		}
+		
+		// select a version with the cloud dimension fixed at compile time when one exists,
+		// so that the per-point distance loops are fully unrolled for the common low dimensions
+		switch (dim)
+		{
+			case 2: return onePointKnn<2>(query, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+			case 3: return onePointKnn<3>(query, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+			case 4: return onePointKnn<4>(query, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+			default: return onePointKnn<-1>(query, heap, off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats);
+		}
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT> template<int staticDim>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::onePointKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults, QueryStatistics& stats) const
+	{
+		fill(off.begin(), off.end(), 0);
+		heap.reset();
+		unsigned long leafTouchedCount(0);
+		const double startTime(collectStatistics ? wallTime() : 0);
+
+		if (quantizedBuckets)
+		{
+			if (allowSelfMatch)
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<true, true, false, true, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<true, false, false, true, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+			else
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<false, true, false, true, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<false, false, false, true, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+		}
+		else if (soaBuckets)
+		{
+			if (allowSelfMatch)
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<true, true, true, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<true, false, true, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+			else
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<false, true, true, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<false, false, true, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+		}
+		else if (heap.size() == 1)
+		{
+			// k = 1: track the single best candidate in two scalars, sparing the heap bookkeeping
+			T bestDist2(numeric_limits<T>::infinity());
+			Index bestIndex(0);
+			if (allowSelfMatch)
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn1<true, true, staticDim>(query, 0, 0, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn1<true, false, staticDim>(query, 0, 0, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+			}
+			else
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn1<false, true, staticDim>(query, 0, 0, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn1<false, false, staticDim>(query, 0, 0, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+			}
+			if (bestDist2 != numeric_limits<T>::infinity())
+				heap.replaceHead(bestIndex, bestDist2);
+		}
+		else
+		{
+			if (allowSelfMatch)
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<true, true, false, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<true, false, false, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+			else
+			{
+				if (collectStatistics)
+					leafTouchedCount += recurseKnn<false, true, false, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<false, false, false, false, staticDim>(query, 0, 0, heap, off, maxError2, maxRadius2, stats);
+			}
+		}
+
+		if (collectStatistics)
+			stats.seconds = wallTime() - startTime;
+
+		if (sortResults)
+			heap.sort();
+		
+		return leafTouchedCount;
+	}
+	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	typename NearestNeighbourSearch<T, Cloud_T>::SearchContext* KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::createSearchContext(const Index k) const
+	{
+		return new KnnSearchContext(k, dim);
+	}
+	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::knn(SearchContext& context, const Vector& query, IndexVector& indices, Vector& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		KnnSearchContext* ctx(dynamic_cast<KnnSearchContext*>(&context));
+		if (!ctx)
+			throw runtime_error("Search context was not created by createSearchContext() of this search");
+		if (ctx->k != k)
+			throw runtime_error((boost::format("Search context was created for %1% neighbours but %2% are requested") % ctx->k % k).str());
+		
+		// checks of checkSizesKnn, on the single-point arguments
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		if (allowSelfMatch)
+		{
+			if (k > cloud.cols())
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud (%2%)") % k % cloud.cols()).str());
+		}
+		else
+		{
+			if (k > cloud.cols()-1)
+				throw runtime_error((boost::format("Requesting more points (%1%) than available in cloud minus 1 (%2%) (as self match is forbidden)") % k % (cloud.cols()-1)).str());
+		}
+		if (query.size() < dim)
+			throw runtime_error((boost::format("Query has less dimensions (%1%) than requested for cloud (%2%)") % query.size() % dim).str());
+		if (indices.size() != k)
+			throw runtime_error((boost::format("Index vector has a different size (%1%) than k (%2%)") % indices.size() % k).str());
+		if (dists2.size() != k)
+			throw runtime_error((boost::format("Distance vector has a different size (%1%) than k (%2%)") % dists2.size() % k).str());
+		
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
+		const T maxRadius2(maxRadius * maxRadius);
+		const T maxError2((1+epsilon)*(1+epsilon));
+		
+		assert(nodes.size() > 0);
+		
+		// per-query statistics go to a local, so that no vector is touched on this path
+		QueryStatistics stats;
+		const unsigned long leafTouchedCount(onePointKnn(&query.coeff(0,0), ctx->heap, ctx->off, maxError2, maxRadius2, allowSelfMatch, collectStatistics, sortResults, stats));
+		ctx->heap.getData(indices, dists2);
+		return leafTouchedCount;
+	}
+	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT> template<bool allowSelfMatch>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::bestBinFirstKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool collectStatistics, QueryStatistics& stats) const
+	{
+		const int dimCount(dim);
+		std::priority_queue<BBFEntry> queue;
+		// arena of offset vectors, one per queued subtree; indexed instead of held in the
+		// entries so that the queue stays small and entry copies stay cheap
+		std::vector<T> offs(off.begin(), off.end());
+		queue.push(BBFEntry(0, 0, 0));
+		unsigned long leafTouchedCount(0);
+		unsigned leafVisited(0);
+		
+		while (!queue.empty())
+		{
+			const BBFEntry e(queue.top());
+			queue.pop();
+			// entries come out closest first, so no remaining subtree can contribute either
+			if ((e.rd > maxRadius2) || (e.rd * maxError2 >= heap.headValue()))
+				break;
+			
+			// walk down to the closest bucket of the subtree, queuing the subtrees left aside
+			T rd(e.rd);
+			copy(offs.begin() + e.offIndex, offs.begin() + e.offIndex + dimCount, off.begin());
+			unsigned n(e.n);
+			const Node* node(&nodes[n]);
+			uint32_t cd(getDim(node->dimChildBucketSize));
+			if (collectStatistics)
+				++stats.nodesVisited;
+			while (cd != uint32_t(dimCount))
+			{
+				const size_t rightChild(getChildBucketSize(node->dimChildBucketSize));
+				const T old_off(off[cd]);
+				const T new_off(query[cd] - node->cutVal);
+				const T farRd(rd - old_off*old_off + new_off*new_off);
+				unsigned farChild;
+				if (new_off > 0)
+				{
+					farChild = n + 1;
+					n = rightChild;
+				}
+				else
+				{
+					farChild = rightChild;
+					n = n + 1;
+				}
+				if ((farRd <= maxRadius2) && (farRd * maxError2 < heap.headValue()))
+				{
+					const uint32_t offIndex(offs.size());
+					offs.insert(offs.end(), off.begin(), off.begin() + dimCount);
+					offs[offIndex + cd] = new_off;
+					queue.push(BBFEntry(farRd, farChild, offIndex));
+				}
+				node = &nodes[n];
+				cd = getDim(node->dimChildBucketSize);
+				if (collectStatistics)
+					++stats.nodesVisited;
+			}
+			
+			// scan the bucket
+			const BucketEntry* bucket(&buckets[node->bucketIndex]);
+			const size_t bucketSize(getChildBucketSize(node->dimChildBucketSize));
+			if (collectStatistics)
+			{
+				++stats.bucketsScanned;
+				stats.pointsTouched += bucketSize;
+			}
+			for (size_t i = 0; i < bucketSize; ++i)
+			{
+				T dist(0);
+				const T* qPtr(query);
+				const T* dPtr(bucket->pt);
+				for (int d = 0; d < dimCount; ++d)
+				{
+					const T diff(*qPtr - *dPtr);
+					dist += diff*diff;
+					qPtr++; dPtr++;
+				}
+				if ((dist <= maxRadius2) &&
+					(dist < heap.headValue()) &&
+					(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+				)
+				{
+					if (collectStatistics)
+						++stats.heapReplacements;
+					heap.replaceHead(bucket->index, dist);
+				}
+				++bucket;
+			}
+			leafTouchedCount += bucketSize;
+			if (++leafVisited >= maxLeafVisited)
+				break;
+		}
+		return leafTouchedCount;
+	}
+	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT> template<bool allowSelfMatch, bool collectStatistics, int staticDim>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::recurseKnn1(const T* query, const size_t n, T rd, T& bestDist2, Index& bestIndex, std::vector<T>& off, const T maxError2, const T maxRadius2, QueryStatistics& stats) const
+	{
+		const int dimCount(staticDim == -1 ? int(dim) : staticDim);
+		const Node& node(nodes[n]);
+		const uint32_t cd(getDim(node.dimChildBucketSize));
+		if (collectStatistics)
+			++stats.nodesVisited;
+
+		if (cd == uint32_t(dimCount))
+		{
+			const BucketEntry* bucket(&buckets[node.bucketIndex]);
+			const size_t bucketSize(getChildBucketSize(node.dimChildBucketSize));
+			if (collectStatistics)
+			{
+				++stats.bucketsScanned;
+				stats.pointsTouched += bucketSize;
+			}
+			for (size_t i = 0; i < bucketSize; ++i)
+			{
+				T dist(0);
+				const T* qPtr(query);
+				const T* dPtr(bucket->pt);
+				for (int i = 0; i < dimCount; ++i)
+				{
+					const T diff(*qPtr - *dPtr);
+					dist += diff*diff;
+					qPtr++; dPtr++;
+				}
+				if ((dist <= maxRadius2) &&
+					(dist < bestDist2) &&
+					(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+				)
+				{
+					if (collectStatistics)
+						++stats.heapReplacements;
+					bestDist2 = dist;
+					bestIndex = bucket->index;
+				}
+				++bucket;
+			}
+			return (unsigned long)(bucketSize);
+		}
+		else
+		{
+			const size_t rightChild(getChildBucketSize(node.dimChildBucketSize));
+			unsigned long leafVisitedCount(0);
+			T& offcd(off[cd]);
+			const T old_off(offcd);
+			const T new_off(query[cd] - node.cutVal);
+			if (new_off > 0)
+			{
+				if (collectStatistics)
+					leafVisitedCount += recurseKnn1<allowSelfMatch, true, staticDim>(query, rightChild, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn1<allowSelfMatch, false, staticDim>(query, rightChild, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				rd += - old_off*old_off + new_off*new_off;
+				if ((rd <= maxRadius2) &&
+					(rd * maxError2 < bestDist2))
+				{
+					offcd = new_off;
+					if (collectStatistics)
+						leafVisitedCount += recurseKnn1<allowSelfMatch, true, staticDim>(query, n + 1, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+					else
+						recurseKnn1<allowSelfMatch, false, staticDim>(query, n + 1, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+					offcd = old_off;
+				}
+			}
+			else
+			{
+				if (collectStatistics)
+					leafVisitedCount += recurseKnn1<allowSelfMatch, true, staticDim>(query, n+1, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn1<allowSelfMatch, false, staticDim>(query, n+1, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+				rd += - old_off*old_off + new_off*new_off;
+				if ((rd <= maxRadius2) &&
+					(rd * maxError2 < bestDist2))
+				{
+					offcd = new_off;
+					if (collectStatistics)
+						leafVisitedCount += recurseKnn1<allowSelfMatch, true, staticDim>(query, rightChild, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+					else
+						recurseKnn1<allowSelfMatch, false, staticDim>(query, rightChild, rd, bestDist2, bestIndex, off, maxError2, maxRadius2, stats);
+					offcd = old_off;
+				}
+			}
+			return leafVisitedCount;
+		}
+	}
+	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT> template<bool allowSelfMatch, bool collectStatistics, bool soaScan, bool quantScan, int staticDim>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::recurseKnn(const T* query, const size_t n, T rd, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, QueryStatistics& stats) const
+	{
+		const int dimCount(staticDim == -1 ? int(dim) : staticDim);
+		const Node& node(nodes[n]);
+		const uint32_t cd(getDim(node.dimChildBucketSize));
+		if (collectStatistics)
+			++stats.nodesVisited;
+
+		if (cd == uint32_t(dimCount))
+		{
+			//cerr << "entering bucket " << node.bucket << endl;
+			const BucketEntry* bucket(&buckets[node.bucketIndex]);
+			const size_t bucketSize(getChildBucketSize(node.dimChildBucketSize));
+			if (collectStatistics)
+			{
+				++stats.bucketsScanned;
+				stats.pointsTouched += bucketSize;
+			}
+			if (quantScan)
+			{
+				// compute approximate distances over the 16-bit quantized coordinates,
+				// and fall back to the full-precision point only when the approximation
+				// cannot rule the point out against the heap or radius bound
+				T dists[maxSoABucketSize];
+				const uint16_t* block(&quantizedCoords[size_t(node.bucketIndex) * dim]);
+				fill(dists, dists + bucketSize, T(0));
+				for (int d = 0; d < dimCount; ++d)
+				{
+					const T q0(query[d] - minBound(d));
+					const T step(quantStep[d]);
+					const uint16_t* coord(block + size_t(d) * bucketSize);
+					for (size_t i = 0; i < bucketSize; ++i)
+					{
+						const T diff(q0 - T(coord[i]) * step);
+						dists[i] += diff*diff;
+					}
+				}
+				const T inf(numeric_limits<T>::infinity());
+				const T maxRadiusInfl(maxRadius2 == inf ? inf : sqr(sqrt(maxRadius2) + quantHalfDiagonal));
+				T head(heap.headValue());
+				T headInfl(head == inf ? inf : sqr(sqrt(head) + quantHalfDiagonal));
+				for (size_t i = 0; i < bucketSize; ++i)
+				{
+					if ((dists[i] >= headInfl) || (dists[i] > maxRadiusInfl))
+						continue;
+					// refine with the exact distance
+					T dist(0);
+					const T* qPtr(query);
+					const T* dPtr(bucket[i].pt);
+					for (int d = 0; d < dimCount; ++d)
+					{
+						const T diff(*qPtr - *dPtr);
+						dist += diff*diff;
+						qPtr++; dPtr++;
+					}
+					if ((dist <= maxRadius2) &&
+						(dist < head) &&
+						(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+					)
+					{
+						if (collectStatistics)
+							++stats.heapReplacements;
+						heap.replaceHead(bucket[i].index, dist);
+						head = heap.headValue();
+						headInfl = (head == inf ? inf : sqr(sqrt(head) + quantHalfDiagonal));
+					}
+				}
+				return (unsigned long)(bucketSize);
+			}
+			if (soaScan)
+			{
+				// compute all distances of the bucket first, over contiguous
+				// structure-of-arrays coordinates the compiler can vectorise,
+				// then update the heap with the few points that qualify
+				T dists[maxSoABucketSize];
+				const T* block(&bucketCoords[size_t(node.bucketIndex) * dim]);
+				fill(dists, dists + bucketSize, T(0));
+				for (int d = 0; d < dimCount; ++d)
+				{
+					const T qd(query[d]);
+					const T* coord(block + size_t(d) * bucketSize);
+					for (size_t i = 0; i < bucketSize; ++i)
+					{
+						const T diff(qd - coord[i]);
+						dists[i] += diff*diff;
+					}
+				}
+				for (size_t i = 0; i < bucketSize; ++i)
+				{
+					const T dist(dists[i]);
+					if ((dist <= maxRadius2) &&
+						(dist < heap.headValue()) &&
+						(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+					)
+					{
+						if (collectStatistics)
+							++stats.heapReplacements;
+						heap.replaceHead(bucket[i].index, dist);
+					}
+				}
+				return (unsigned long)(bucketSize);
+			}
+			for (size_t i = 0; i < bucketSize; ++i)
+			{
+				//cerr << "  " << bucket-> pt << endl;
+				//const T dist(dist2<T>(query, cloud.col(index)));
+				//const T dist((query - cloud.col(index)).squaredNorm());
+				T dist(0);
+				const T* qPtr(query);
+				const T* dPtr(bucket->pt);
+				for (int i = 0; i < dimCount; ++i)
+				{
+					const T diff(*qPtr - *dPtr);
+					dist += diff*diff;
+					qPtr++; dPtr++;
+				}
+				if ((dist <= maxRadius2) &&
+					(dist < heap.headValue()) &&
+					(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+				)
+				{
+					if (collectStatistics)
+						++stats.heapReplacements;
+					heap.replaceHead(bucket->index, dist);
+				}
+				++bucket;
+			}
+			return (unsigned long)(bucketSize);
+		}
+		else
+		{
+			const size_t rightChild(getChildBucketSize(node.dimChildBucketSize));
+			unsigned long leafVisitedCount(0);
+			T& offcd(off[cd]);
+			//const T old_off(off.coeff(cd));
+			const T old_off(offcd);
+			const T new_off(query[cd] - node.cutVal);
+			if (new_off > 0)
+			{
+				if (collectStatistics)
+					leafVisitedCount += recurseKnn<allowSelfMatch, true, soaScan, quantScan, staticDim>(query, rightChild, rd, heap, off, maxError2, maxRadius2, stats);
+				else
+					recurseKnn<allowSelfMatch, false, soaScan, quantScan, staticDim>(query, rightChild, rd, heap, off, maxError2, maxRadius2, stats);
+				rd += - old_off*old_off + new_off*new_off;
+				if ((rd <= maxRadius2) &&
 					(rd * maxError2 < heap.headValue()))
 				{
 					offcd = new_off;
 					if (collectStatistics)
-						leafVisitedCount += recurseKnn<allowSelfMatch, true>(query, n + 1, rd, heap, off, maxError2, maxRadius2);
+						leafVisitedCount += recurseKnn<allowSelfMatch, true, soaScan, quantScan, staticDim>(query, n + 1, rd, heap, off, maxError2, maxRadius2, stats);
 					else
-						recurseKnn<allowSelfMatch, false>(query, n + 1, rd, heap, off, maxError2, maxRadius2);
+						recurseKnn<allowSelfMatch, false, soaScan, quantScan, staticDim>(query, n + 1, rd, heap, off, maxError2, maxRadius2, stats);
 					offcd = old_off;
 				}
 			}
 			else
 			{
 				if (collectStatistics)
-					leafVisitedCount += recurseKnn<allowSelfMatch, true>(query, n+1, rd, heap, off, maxError2, maxRadius2);
+					leafVisitedCount += recurseKnn<allowSelfMatch, true, soaScan, quantScan, staticDim>(query, n+1, rd, heap, off, maxError2, maxRadius2, stats);
 				else
-					recurseKnn<allowSelfMatch, false>(query, n+1, rd, heap, off, maxError2, maxRadius2);
+					recurseKnn<allowSelfMatch, false, soaScan, quantScan, staticDim>(query, n+1, rd, heap, off, maxError2, maxRadius2, stats);
 				rd += - old_off*old_off + new_off*new_off;
 				if ((rd <= maxRadius2) &&
 					(rd * maxError2 < heap.headValue()))
 				{
 					offcd = new_off;
 					if (collectStatistics)
-						leafVisitedCount += recurseKnn<allowSelfMatch, true>(query, rightChild, rd, heap, off, maxError2, maxRadius2);
+						leafVisitedCount += recurseKnn<allowSelfMatch, true, soaScan, quantScan, staticDim>(query, rightChild, rd, heap, off, maxError2, maxRadius2, stats);
 					else
-						recurseKnn<allowSelfMatch, false>(query, rightChild, rd, heap, off, maxError2, maxRadius2);
+						recurseKnn<allowSelfMatch, false, soaScan, quantScan, staticDim>(query, rightChild, rd, heap, off, maxError2, maxRadius2, stats);
 					offcd = old_off;
 				}
 			}
@@ -448,10 +1454,117 @@ namespace Nabo
 		}
 	}
 	
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT>
+	unsigned long KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags) const
+	{
+		if (query.size() < dim)
+			throw runtime_error((boost::format("Query has less dimensions (%1%) than requested for cloud (%2%)") % query.size() % dim).str());
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const T radius2(radius * radius);
+
+		assert(nodes.size() > 0);
+
+		indices.clear();
+		dists2.clear();
+		std::vector<T> off(dim, 0);
+		if (allowSelfMatch)
+			recurseRange<true>(&query.coeff(0), 0, 0, off, radius2, indices, dists2);
+		else
+			recurseRange<false>(&query.coeff(0), 0, 0, off, radius2, indices, dists2);
+		if (sortResults)
+			sortRadiusResults(indices, dists2);
+		return indices.size();
+	}
+
+	template<typename T, typename Heap, typename Cloud_T, typename PackedIndexT> template<bool allowSelfMatch>
+	void KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap, Cloud_T, PackedIndexT>::recurseRange(const T* query, const size_t n, T rd, std::vector<T>& off, const T maxRadius2, std::vector<Index>& indices, std::vector<T>& dists2) const
+	{
+		const Node& node(nodes[n]);
+		const uint32_t cd(getDim(node.dimChildBucketSize));
+
+		if (cd == uint32_t(dim))
+		{
+			const BucketEntry* bucket(&buckets[node.bucketIndex]);
+			const size_t bucketSize(getChildBucketSize(node.dimChildBucketSize));
+			for (size_t i = 0; i < bucketSize; ++i)
+			{
+				T dist(0);
+				const T* qPtr(query);
+				const T* dPtr(bucket->pt);
+				for (int j = 0; j < this->dim; ++j)
+				{
+					const T diff(*qPtr - *dPtr);
+					dist += diff*diff;
+					qPtr++; dPtr++;
+				}
+				if ((dist <= maxRadius2) &&
+					(allowSelfMatch || (dist > numeric_limits<T>::epsilon()))
+				)
+				{
+					indices.push_back(bucket->index);
+					dists2.push_back(dist);
+				}
+				++bucket;
+			}
+		}
+		else
+		{
+			const size_t rightChild(getChildBucketSize(node.dimChildBucketSize));
+			T& offcd(off[cd]);
+			const T old_off(offcd);
+			const T new_off(query[cd] - node.cutVal);
+			if (new_off > 0)
+			{
+				recurseRange<allowSelfMatch>(query, rightChild, rd, off, maxRadius2, indices, dists2);
+				rd += - old_off*old_off + new_off*new_off;
+				if (rd <= maxRadius2)
+				{
+					offcd = new_off;
+					recurseRange<allowSelfMatch>(query, n + 1, rd, off, maxRadius2, indices, dists2);
+					offcd = old_off;
+				}
+			}
+			else
+			{
+				recurseRange<allowSelfMatch>(query, n + 1, rd, off, maxRadius2, indices, dists2);
+				rd += - old_off*old_off + new_off*new_off;
+				if (rd <= maxRadius2)
+				{
+					offcd = new_off;
+					recurseRange<allowSelfMatch>(query, rightChild, rd, off, maxRadius2, indices, dists2);
+					offcd = old_off;
+				}
+			}
+		}
+	}
+
 	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapSTL<int,float> >;
 	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapBruteForceVector<int,float> >;
 	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapSTL<int,double> >;
 	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapBruteForceVector<int,double> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float>, Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, uint64_t>;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double>, Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, uint64_t>;
+#ifdef EIGEN3_API
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapSTL<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapBruteForceVector<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapSTL<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapBruteForceVector<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapSTL<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapBruteForceVector<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapSTL<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapBruteForceVector<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned>, uint64_t>;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned>, uint64_t>;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> >, uint64_t>;
+	template struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> >, uint64_t>;
+#endif // EIGEN3_API
 	
 	//@}
 }
@@ -0,0 +1,297 @@
+/*
+
+Copyright (c) 2010--2011, Stephane Magnenat, ASL, ETHZ, Switzerland
+You can contact the author at <stephane at magnenat dot net>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETH-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "nabo_private.h"
+#include "index_heap.h"
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+/*!	\file kdtree_dynamic_cpu.cpp
+	\brief dynamic kd-tree search supporting incremental updates, cpu implementation
+	\ingroup private
+*/
+
+namespace Nabo
+{
+	//! \ingroup private
+	//@{
+
+	using namespace std;
+
+	template<typename T, typename Heap>
+	KDTreeDynamic<T, Heap>::KDTreeDynamic(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters):
+		DynamicCloudStorage<T>(cloud),
+		NearestNeighbourSearch<T>::NearestNeighbourSearch(points, dim, creationOptionFlags),
+		additionalParameters(additionalParameters),
+		rebuildThreshold(additionalParameters.get<unsigned>("rebuildThreshold", 0)),
+		tree(new Tree(points, this->dim, creationOptionFlags, additionalParameters)),
+		treeCols(points.cols()),
+		removed(points.cols(), false),
+		removedCount(0)
+	{
+		const_cast<Vector&>(minBound) = tree->minBound;
+		const_cast<Vector&>(maxBound) = tree->maxBound;
+	}
+
+	template<typename T, typename Heap>
+	KDTreeDynamic<T, Heap>::~KDTreeDynamic()
+	{
+		delete tree;
+	}
+
+	template<typename T, typename Heap>
+	unsigned KDTreeDynamic<T, Heap>::effectiveRebuildThreshold() const
+	{
+		if (rebuildThreshold != 0)
+			return rebuildThreshold;
+		return max<unsigned>(64, unsigned(treeCols) / 8);
+	}
+
+	template<typename T, typename Heap>
+	void KDTreeDynamic<T, Heap>::rebuild()
+	{
+		const Index totalCount(points.cols());
+		const Index liveCount(totalCount - removedCount);
+		if (liveCount == 0)
+			throw runtime_error("A dynamic kd-tree must keep at least one point");
+
+		// compact live points into a new cloud
+		Matrix newPoints(dim, liveCount);
+		Index j(0);
+		for (Index i = 0; i < totalCount; ++i)
+			if (!removed[i])
+				newPoints.col(j++) = points.block(0, i, dim, 1);
+		assert(j == liveCount);
+
+		// the old tree holds pointers into points, delete it before swapping the storage
+		delete tree;
+		tree = 0;
+		points.swap(newPoints);
+		treeCols = points.cols();
+		removed.assign(points.cols(), false);
+		removedCount = 0;
+
+		tree = new Tree(points, dim, creationOptionFlags, additionalParameters);
+		const_cast<Vector&>(minBound) = tree->minBound;
+		const_cast<Vector&>(maxBound) = tree->maxBound;
+	}
+
+	template<typename T, typename Heap>
+	void KDTreeDynamic<T, Heap>::addPoints(const Matrix& newPoints)
+	{
+		if (newPoints.rows() < dim)
+			throw runtime_error((boost::format("Points to add have less dimensions (%1%) than the cloud (%2%)") % newPoints.rows() % dim).str());
+		const Index count(newPoints.cols());
+		if (count == 0)
+			return;
+
+		// append to points, so that the public cloud stays consistent with the indices
+		// returned by searches; the resize reallocates the storage, but keeps the column
+		// layout of the indexed points, so the pointers cached by the main tree can be refreshed
+		const Index oldCols(points.cols());
+		points.conservativeResize(points.rows(), oldCols + count);
+		for (Index i = 0; i < count; ++i)
+		{
+			const Vector& v(newPoints.block(0, i, dim, 1));
+			points.block(0, oldCols + i, dim, 1) = v;
+#ifdef EIGEN3_API
+			const_cast<Vector&>(minBound) = minBound.array().min(v.array());
+			const_cast<Vector&>(maxBound) = maxBound.array().max(v.array());
+#else // EIGEN3_API
+			const_cast<Vector&>(minBound) = minBound.cwise().min(v);
+			const_cast<Vector&>(maxBound) = maxBound.cwise().max(v);
+#endif // EIGEN3_API
+		}
+		if (tree)
+			tree->rebindCloud();
+		removed.resize(points.cols(), false);
+
+		if (unsigned(points.cols() - treeCols + removedCount) >= effectiveRebuildThreshold())
+			rebuild();
+	}
+
+	template<typename T, typename Heap>
+	void KDTreeDynamic<T, Heap>::removePoints(const IndexVector& indices)
+	{
+		const Index totalCount(points.cols());
+		for (int i = 0; i < indices.size(); ++i)
+		{
+			const Index index(indices[i]);
+			if (index < 0 || index >= totalCount)
+				throw runtime_error((boost::format("Point index %1% to remove is out of range [0:%2%[") % index % totalCount).str());
+			if (!removed[index])
+			{
+				removed[index] = true;
+				++removedCount;
+			}
+		}
+
+		if (unsigned(points.cols() - treeCols + removedCount) >= effectiveRebuildThreshold())
+			rebuild();
+	}
+
+	template<typename T, typename Heap>
+	unsigned long KDTreeDynamic<T, Heap>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		const Vector maxRadii(Vector::Constant(query.cols(), maxRadius));
+		return knn(query, indices, dists2, maxRadii, k, epsilon, optionFlags);
+	}
+
+	template<typename T, typename Heap>
+	unsigned long KDTreeDynamic<T, Heap>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
+	{
+		checkSizesKnn(query, indices, dists2, k, optionFlags, &maxRadii);
+
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
+		// checkSizesKnn validates k against the column count of the cloud, which still
+		// includes removed points; validate against the number of live points instead
+		const Index liveCount(points.cols() - removedCount);
+		if (allowSelfMatch)
+		{
+			if (k > liveCount)
+				throw runtime_error((boost::format("Requesting more points (%1%) than live in cloud (%2%)") % k % liveCount).str());
+		}
+		else
+		{
+			if (k > liveCount - 1)
+				throw runtime_error((boost::format("Requesting more points (%1%) than live in cloud minus 1 (%2%) (as self match is forbidden)") % k % (liveCount - 1)).str());
+		}
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		const Index sideCount(points.cols() - treeCols);
+		unsigned long leafTouchedCount(0);
+
+		// query the main tree with extra neighbours to compensate for removed points still in it
+		Index kTree(0);
+		IndexMatrix treeIndices;
+		Matrix treeDists2;
+		if (tree)
+		{
+			kTree = min(k + removedCount, allowSelfMatch ? treeCols : treeCols - 1);
+			if (kTree > 0)
+			{
+				treeIndices.resize(kTree, query.cols());
+				treeDists2.resize(kTree, query.cols());
+				leafTouchedCount += tree->knn(query, treeIndices, treeDists2, maxRadii, kTree, epsilon, optionFlags & ~unsigned(NearestNeighbourSearch<T>::SORT_RESULTS));
+			}
+		}
+
+		Heap heap(k);
+		for (int c = 0; c < query.cols(); ++c)
+		{
+			const T maxRadius(maxRadii[c]);
+			const T maxRadius2(maxRadius * maxRadius);
+			const Vector& q(query.block(0, c, dim, 1));
+			heap.reset();
+
+			// merge the tree results, masking out removed points
+			for (Index r = 0; r < kTree; ++r)
+			{
+				const T dist(treeDists2(r, c));
+				const Index index(treeIndices(r, c));
+				if ((dist < heap.headValue()) && (!removed[index]))
+					heap.replaceHead(index, dist);
+			}
+
+			// brute-force scan of the side buffer
+			for (Index i = 0; i < sideCount; ++i)
+			{
+				if (removed[treeCols + i])
+					continue;
+				const T dist(dist2<T>(points.block(0, treeCols + i, dim, 1), q));
+				if ((dist <= maxRadius2) &&
+					(dist < heap.headValue()) &&
+					(allowSelfMatch || (dist > numeric_limits<T>::epsilon())))
+					heap.replaceHead(treeCols + i, dist);
+			}
+
+			if (sortResults)
+				heap.sort();
+			heap.getData(indices.col(c), dists2.col(c));
+		}
+		if (collectStatistics)
+			leafTouchedCount += (unsigned long)query.cols() * (unsigned long)sideCount;
+		return leafTouchedCount;
+	}
+
+	template<typename T, typename Heap>
+	unsigned long KDTreeDynamic<T, Heap>::radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags) const
+	{
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T>::SORT_RESULTS);
+		const T radius2(radius * radius);
+		const Index sideCount(points.cols() - treeCols);
+
+		indices.clear();
+		dists2.clear();
+		if (tree)
+		{
+			// search the main tree, then mask out removed points in place
+			tree->radiusSearch(query, radius, indices, dists2, optionFlags & ~unsigned(NearestNeighbourSearch<T>::SORT_RESULTS));
+			size_t kept(0);
+			for (size_t i = 0; i < indices.size(); ++i)
+			{
+				if (removed[indices[i]])
+					continue;
+				indices[kept] = indices[i];
+				dists2[kept] = dists2[i];
+				++kept;
+			}
+			indices.resize(kept);
+			dists2.resize(kept);
+		}
+
+		// brute-force scan of the side buffer
+		const Vector& q(query.block(0, 0, dim, 1));
+		for (Index i = 0; i < sideCount; ++i)
+		{
+			if (removed[treeCols + i])
+				continue;
+			const T dist(dist2<T>(points.block(0, treeCols + i, dim, 1), q));
+			if ((dist <= radius2) &&
+				(allowSelfMatch || (dist > numeric_limits<T>::epsilon())))
+			{
+				indices.push_back(treeCols + i);
+				dists2.push_back(dist);
+			}
+		}
+		if (sortResults)
+			sortRadiusResults(indices, dists2);
+		return indices.size();
+	}
+
+	template struct KDTreeDynamic<float,IndexHeapBruteForceVector<int,float> >;
+	template struct KDTreeDynamic<double,IndexHeapBruteForceVector<int,double> >;
+
+	//@}
+}
@@ -0,0 +1,287 @@
+/*
+
+Copyright (c) 2010--2011, Stephane Magnenat, ASL, ETHZ, Switzerland
+You can contact the author at <stephane at magnenat dot net>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETH-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "nabo_private.h"
+#include "index_heap.h"
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <boost/format.hpp>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif // HAVE_OPENMP
+
+/*!	\file kdtree_forest_cpu.cpp
+	\brief kd-tree forest over spatial shards, cpu implementation
+	\ingroup private
+*/
+
+namespace Nabo
+{
+	//! \ingroup private
+	//@{
+
+	using namespace std;
+
+	//! order point indices by their coordinate along one dimension
+	template<typename T, typename CloudType>
+	struct CoordinateCompare
+	{
+		//! cloud holding the points
+		const CloudType& cloud;
+		//! dimension along which to compare
+		const int d;
+		//! constructor
+		CoordinateCompare(const CloudType& cloud, const int d): cloud(cloud), d(d) {}
+		//! return true if point a comes before point b along dimension d
+		bool operator()(const int a, const int b) const { return cloud.coeff(d, a) < cloud.coeff(d, b); }
+	};
+
+	template<typename T, typename Heap, typename Cloud_T>
+	KDTreeForest<T, Heap, Cloud_T>::KDTreeForest(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters):
+		NearestNeighbourSearch<T, Cloud_T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags),
+		maxThreads(additionalParameters.get<unsigned>("maxThreads", 0))
+	{
+		if (cloud.cols() == 0)
+			throw runtime_error("Cloud has no points");
+
+		const Index pointCount(cloud.cols());
+		unsigned shardCount(additionalParameters.get<unsigned>("shardCount", 0));
+		if (shardCount == 0)
+		{
+#ifdef HAVE_OPENMP
+			shardCount = omp_get_max_threads();
+#else // HAVE_OPENMP
+			shardCount = 1;
+#endif // HAVE_OPENMP
+		}
+		// keep shards large enough that the per-shard trees remain worthwhile
+		shardCount = max(1u, min(shardCount, unsigned(max<Index>(1, pointCount / 64))));
+
+		// partition the cloud by recursive median splits along the widest dimension,
+		// always splitting the range that holds the most points
+		std::vector<int> perm(pointCount);
+		for (Index i = 0; i < pointCount; ++i)
+			perm[i] = i;
+		typedef std::pair<Index, Index> Range;
+		std::vector<Range> ranges(1, Range(0, pointCount));
+		while (ranges.size() < shardCount)
+		{
+			size_t largest(0);
+			for (size_t i = 1; i < ranges.size(); ++i)
+				if (ranges[i].second - ranges[i].first > ranges[largest].second - ranges[largest].first)
+					largest = i;
+			const Range r(ranges[largest]);
+			if (r.second - r.first < 2)
+				break;
+			// bounding box of the range, to find its widest dimension
+			Vector lo(Vector::Constant(dim, numeric_limits<T>::max()));
+			Vector hi(Vector::Constant(dim, -numeric_limits<T>::max()));
+			for (Index i = r.first; i < r.second; ++i)
+			{
+				for (Index d = 0; d < dim; ++d)
+				{
+					const T v(cloud.coeff(d, perm[i]));
+					if (v < lo[d])
+						lo[d] = v;
+					if (v > hi[d])
+						hi[d] = v;
+				}
+			}
+			int splitDim(0);
+			for (Index d = 1; d < dim; ++d)
+				if (hi[d] - lo[d] > hi[splitDim] - lo[splitDim])
+					splitDim = d;
+			const Index mid((r.first + r.second) / 2);
+			nth_element(perm.begin() + r.first, perm.begin() + mid, perm.begin() + r.second, CoordinateCompare<T, CloudType>(cloud, splitDim));
+			ranges[largest] = Range(r.first, mid);
+			ranges.push_back(Range(mid, r.second));
+		}
+
+		// build one tree per shard in parallel; each worker fills its own shard's storage,
+		// so on NUMA machines first-touch page placement keeps it local to the worker's node
+		const int builtShardCount(ranges.size());
+		shards.resize(builtShardCount, (Shard*)0);
+#ifdef HAVE_OPENMP
+		#pragma omp parallel for schedule(dynamic)
+#endif // HAVE_OPENMP
+		for (int s = 0; s < builtShardCount; ++s)
+		{
+			Shard* shard(new Shard);
+			const Index first(ranges[s].first);
+			const Index count(ranges[s].second - ranges[s].first);
+			shard->points.resize(dim, count);
+			shard->globalIndices.resize(count);
+			for (Index i = 0; i < count; ++i)
+			{
+				const Index g(perm[first + i]);
+				shard->points.col(i) = cloud.block(0, g, dim, 1);
+				shard->globalIndices[i] = g;
+			}
+			shard->tree = new Tree(shard->points, dim, creationOptionFlags, additionalParameters);
+			shards[s] = shard;
+		}
+
+		// the cloud bounds are the union of the shard bounds
+		for (int s = 0; s < builtShardCount; ++s)
+		{
+#ifdef EIGEN3_API
+			const_cast<Vector&>(minBound) = minBound.array().min(shards[s]->tree->minBound.array());
+			const_cast<Vector&>(maxBound) = maxBound.array().max(shards[s]->tree->maxBound.array());
+#else // EIGEN3_API
+			const_cast<Vector&>(minBound) = minBound.cwise().min(shards[s]->tree->minBound);
+			const_cast<Vector&>(maxBound) = maxBound.cwise().max(shards[s]->tree->maxBound);
+#endif // EIGEN3_API
+		}
+	}
+
+	template<typename T, typename Heap, typename Cloud_T>
+	KDTreeForest<T, Heap, Cloud_T>::~KDTreeForest()
+	{
+		for (size_t s = 0; s < shards.size(); ++s)
+			delete shards[s];
+	}
+
+	template<typename T, typename Heap, typename Cloud_T>
+	T KDTreeForest<T, Heap, Cloud_T>::dist2ToShard(const Vector& query, const Shard& shard) const
+	{
+		const Vector& lo(shard.tree->minBound);
+		const Vector& hi(shard.tree->maxBound);
+		T dist2(0);
+		for (Index d = 0; d < dim; ++d)
+		{
+			T delta(0);
+			if (query[d] < lo[d])
+				delta = lo[d] - query[d];
+			else if (query[d] > hi[d])
+				delta = query[d] - hi[d];
+			dist2 += delta * delta;
+		}
+		return dist2;
+	}
+
+	template<typename T, typename Heap, typename Cloud_T>
+	unsigned long KDTreeForest<T, Heap, Cloud_T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		const Vector maxRadii(Vector::Constant(query.cols(), maxRadius));
+		return knn(query, indices, dists2, maxRadii, k, epsilon, optionFlags);
+	}
+
+	template<typename T, typename Heap, typename Cloud_T>
+	unsigned long KDTreeForest<T, Heap, Cloud_T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const T epsilon, const unsigned optionFlags) const
+	{
+		checkSizesKnn(query, indices, dists2, k, optionFlags, &maxRadii);
+
+		const bool sortResults(optionFlags & NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T, Cloud_T>::TOUCH_STATISTICS);
+		const T maxError2((1+epsilon)*(1+epsilon));
+		const int colCount(query.cols());
+		const int shardCount(shards.size());
+		// shards merge through a common heap, sorting happens at the end if requested
+		const unsigned subOptionFlags(optionFlags & ~unsigned(NearestNeighbourSearch<T, Cloud_T>::SORT_RESULTS));
+
+		// small shards cannot return k points
+		std::vector<Index> shardKs(shardCount);
+		for (int s = 0; s < shardCount; ++s)
+			shardKs[s] = min(k, Index(shards[s]->points.cols()));
+
+		unsigned long leafTouchedCount(0);
+
+#pragma omp parallel num_threads(maxThreads != 0 ? int(maxThreads) : omp_get_max_threads())
+		{
+
+		Heap heap(k);
+		// per-thread per-shard search contexts, created on first use
+		std::vector<typename NearestNeighbourSearch<T>::SearchContext*> contexts(shardCount, (typename NearestNeighbourSearch<T>::SearchContext*)0);
+		std::vector<std::pair<T, int> > shardOrder(shardCount);
+		IndexVector shardIndices;
+		Vector shardDists2;
+
+#pragma omp for reduction(+:leafTouchedCount) schedule(guided,32)
+		for (int c = 0; c < colCount; ++c)
+		{
+			const T maxRadius(maxRadii[c]);
+			const T maxRadius2(maxRadius * maxRadius);
+			const Vector q(query.block(0, c, dim, 1));
+			heap.reset();
+
+			// visit shards by increasing distance to their bounding boxes, stopping as soon as
+			// no remaining shard can contain a point closer than the current worst candidate
+			for (int s = 0; s < shardCount; ++s)
+				shardOrder[s] = make_pair(dist2ToShard(q, *shards[s]), s);
+			sort(shardOrder.begin(), shardOrder.end());
+
+			for (int i = 0; i < shardCount; ++i)
+			{
+				const T boxDist2(shardOrder[i].first);
+				if ((boxDist2 > maxRadius2) || (boxDist2 * maxError2 >= heap.headValue()))
+					break;
+				const int s(shardOrder[i].second);
+				const Shard& shard(*shards[s]);
+				const Index kShard(shardKs[s]);
+				if (!contexts[s])
+					contexts[s] = shard.tree->createSearchContext(kShard);
+				shardIndices.resize(kShard);
+				shardDists2.resize(kShard);
+				leafTouchedCount += shard.tree->knn(*contexts[s], q, shardIndices, shardDists2, kShard, epsilon, subOptionFlags, maxRadius);
+
+				// merge, mapping shard-local indices back to the cloud
+				for (Index r = 0; r < kShard; ++r)
+				{
+					const T dist(shardDists2[r]);
+					if (dist < heap.headValue())
+						heap.replaceHead(shard.globalIndices[shardIndices[r]], dist);
+				}
+			}
+
+			if (sortResults)
+				heap.sort();
+			heap.getData(indices.col(c), dists2.col(c));
+		}
+
+		for (int s = 0; s < shardCount; ++s)
+			delete contexts[s];
+		}
+		return collectStatistics ? leafTouchedCount : 0;
+	}
+
+	template struct KDTreeForest<float,IndexHeapAuto<int,float> >;
+	template struct KDTreeForest<double,IndexHeapAuto<int,double> >;
+#ifdef EIGEN3_API
+	template struct KDTreeForest<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeForest<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct KDTreeForest<float,IndexHeapAuto<int,float>, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct KDTreeForest<double,IndexHeapAuto<int,double>, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+#endif // EIGEN3_API
+
+	//@}
+}
@@ -69,6 +69,10 @@ namespace Nabo
 	
 	//! Maximum number of points acceptable in a query
 	#define MAX_K 32
+	//! Maximum number of points acceptable in a large-k brute-force query
+	#define MAX_BF_LARGE_K 256
+	//! Work-group size of the large-k brute-force kernels
+	#define BF_LARGE_K_GROUP_SIZE 64
 	
 	using namespace std;
 	
@@ -217,9 +221,24 @@ namespace Nabo
 	OpenCLSearch<T>::OpenCLSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const cl_device_type deviceType):
 		NearestNeighbourSearch<T>::NearestNeighbourSearch(cloud, dim, creationOptionFlags),
 		deviceType(deviceType),
-		context(contextManager.createContext(deviceType))
+		context(contextManager.createContext(deviceType)),
+		currentSlot(0),
+		accumulatedVisitCount(0)
 	{
 	}
+
+	template<typename T>
+	void OpenCLSearch<T>::growBuffer(cl::Buffer& buffer, size_t& capacity, const cl_mem_flags flags, const size_t size) const
+	{
+		if (size <= capacity)
+			return;
+		// grow geometrically so steady-state batches reuse the same pinned allocation
+		size_t newCapacity(max(capacity, size_t(1)));
+		while (newCapacity < size)
+			newCapacity *= 2;
+		buffer = cl::Buffer(context, flags, newCapacity);
+		capacity = newCapacity;
+	}
 	
 	template<typename T>
 	void OpenCLSearch<T>::initOpenCL(const char* clFileName, const char* kernelName, const std::string& additionalDefines)
@@ -308,8 +327,14 @@ namespace Nabo
 		cl::Program& program = sourceCacher->cachedPrograms[source];
 		
 		// build kernel and command queue
+		clProgram = program;
 		knnKernel = cl::Kernel(program, kernelName); 
 		queue = cl::CommandQueue(context, devices.back());
+		// the pipeline needs one queue per slot: within a single in-order queue every
+		// command serializes, and the transfers of one batch could never overlap the
+		// kernel of the other
+		for (int i = 0; i < slotCount; ++i)
+			slots[i].queue = cl::CommandQueue(context, devices.back());
 		
 		// map cloud
 		if (!(cloud.Flags & Eigen::DirectAccessBit) || (cloud.Flags & Eigen::RowMajorBit))
@@ -321,6 +346,13 @@ namespace Nabo
 	
 	template<typename T>
 	unsigned long OpenCLSearch<T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		knnEnqueue(query, indices, dists2, k, epsilon, optionFlags, maxRadius);
+		return knnFinish();
+	}
+
+	template<typename T>
+	void OpenCLSearch<T>::knnEnqueue(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
 		checkSizesKnn(query, indices, dists2, k);
 		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
@@ -333,25 +365,37 @@ namespace Nabo
 		if (query.stride() != cloud.stride() ||
 			query.rows() != cloud.rows())
 			throw runtime_error("query is not of the same dimensionality as the point cloud");
-		
-		// map query
 		if (!(query.Flags & Eigen::DirectAccessBit) || (query.Flags & Eigen::RowMajorBit))
 			throw runtime_error("wrong memory mapping in query data");
-		const size_t queryCLSize(query.cols() * query.stride() * sizeof(T));
-		cl::Buffer queryCL(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, queryCLSize, const_cast<T*>(&query.coeff(0,0)));
-		knnKernel.setArg(1, sizeof(cl_mem), &queryCL);
-		// map indices
 		assert((indices.Flags & Eigen::DirectAccessBit) && (!(indices.Flags & Eigen::RowMajorBit)));
+		assert((dists2.Flags & Eigen::DirectAccessBit) && (!(dists2.Flags & Eigen::RowMajorBit)));
+		
+		// reuse the next slot of the pipeline, waiting for any batch still in flight on it
+		PipelineSlot& slot(slots[currentSlot]);
+		currentSlot = (currentSlot + 1) % slotCount;
+		if (slot.pending)
+		{
+			slot.done.wait();
+			slot.pending = false;
+			if (collectStatistics)
+				for (size_t i = 0; i < slot.visitCounts.size(); ++i)
+					accumulatedVisitCount += (unsigned long)slot.visitCounts[i];
+		}
+		
+		// upload query into the slot's persistent pinned staging buffer
+		const size_t queryCLSize(query.cols() * query.stride() * sizeof(T));
+		growBuffer(slot.queryCL, slot.queryCapacity, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, queryCLSize);
+		slot.queue.enqueueWriteBuffer(slot.queryCL, CL_FALSE, 0, queryCLSize, const_cast<T*>(&query.coeff(0,0)));
+		knnKernel.setArg(1, sizeof(cl_mem), &slot.queryCL);
+		// result staging buffers
 		const int indexStride(indices.stride());
 		const size_t indicesCLSize(indices.cols() * indexStride * sizeof(int));
-		cl::Buffer indicesCL(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, indicesCLSize, &indices.coeffRef(0,0));
-		knnKernel.setArg(2, sizeof(cl_mem), &indicesCL);
-		// map dists2
-		assert((dists2.Flags & Eigen::DirectAccessBit) && (!(dists2.Flags & Eigen::RowMajorBit)));
+		growBuffer(slot.indicesCL, slot.indicesCapacity, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, indicesCLSize);
+		knnKernel.setArg(2, sizeof(cl_mem), &slot.indicesCL);
 		const int dists2Stride(dists2.stride());
 		const size_t dists2CLSize(dists2.cols() * dists2Stride * sizeof(T));
-		cl::Buffer dists2CL(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, dists2CLSize, &dists2.coeffRef(0,0));
-		knnKernel.setArg(3, sizeof(cl_mem), &dists2CL);
+		growBuffer(slot.dists2CL, slot.dists2Capacity, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, dists2CLSize);
+		knnKernel.setArg(3, sizeof(cl_mem), &slot.dists2CL);
 		
 		// set resulting parameters
 		knnKernel.setArg(4, k);
@@ -362,40 +406,54 @@ namespace Nabo
 		knnKernel.setArg(9, dists2Stride);
 		knnKernel.setArg(10, cl_uint(cloud.cols()));
 		
-		// if required, map visit count
-		vector<cl_uint> visitCounts;
+		// if required, prepare visit counts
 		const size_t visitCountCLSize(query.cols() * sizeof(cl_uint));
-		cl::Buffer visitCountCL;
 		if (collectStatistics)
 		{
-			visitCounts.resize(query.cols());
-			visitCountCL = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, visitCountCLSize, &visitCounts[0]);
-			knnKernel.setArg(11, sizeof(cl_mem), &visitCountCL);
+			slot.visitCounts.resize(query.cols());
+			growBuffer(slot.visitCountCL, slot.visitCountCapacity, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, visitCountCLSize);
+			knnKernel.setArg(11, sizeof(cl_mem), &slot.visitCountCL);
 		}
 		
-		// execute query
-		queue.enqueueNDRangeKernel(knnKernel, cl::NullRange, cl::NDRange(query.cols()), cl::NullRange);
-		queue.enqueueMapBuffer(indicesCL, true, CL_MAP_READ, 0, indicesCLSize, 0, 0);
-		queue.enqueueMapBuffer(dists2CL, true, CL_MAP_READ, 0, dists2CLSize, 0, 0);
-		if (collectStatistics)
-			queue.enqueueMapBuffer(visitCountCL, true, CL_MAP_READ, 0, visitCountCLSize, 0, 0);
-		queue.finish();
-		
-		// if required, collect statistics
+		// enqueue the batch without blocking on the slot's own in-order queue: the
+		// write/kernel/read chain of this batch stays ordered, while the device is free
+		// to overlap it with the commands of the batch in flight on the other slot
+		slot.queue.enqueueNDRangeKernel(knnKernel, cl::NullRange, cl::NDRange(query.cols()), cl::NullRange);
+		slot.queue.enqueueReadBuffer(slot.indicesCL, CL_FALSE, 0, indicesCLSize, &indices.coeffRef(0,0));
+		slot.queue.enqueueReadBuffer(slot.dists2CL, CL_FALSE, 0, dists2CLSize, &dists2.coeffRef(0,0));
 		if (collectStatistics)
+			slot.queue.enqueueReadBuffer(slot.visitCountCL, CL_FALSE, 0, visitCountCLSize, &slot.visitCounts[0]);
+		slot.queue.enqueueMarker(&slot.done);
+		slot.queue.flush();
+		slot.pending = true;
+	}
+
+	template<typename T>
+	unsigned long OpenCLSearch<T>::knnFinish() const
+	{
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		unsigned long totalVisitCounts(accumulatedVisitCount);
+		accumulatedVisitCount = 0;
+		// finish slots oldest first
+		for (int i = 0; i < slotCount; ++i)
 		{
-			unsigned long totalVisitCounts(0);
-			for (size_t i = 0; i < visitCounts.size(); ++i)
-				totalVisitCounts += (unsigned long)visitCounts[i];
-			return totalVisitCounts;
+			PipelineSlot& slot(slots[(currentSlot + i) % slotCount]);
+			if (!slot.pending)
+				continue;
+			slot.done.wait();
+			slot.pending = false;
+			if (collectStatistics)
+				for (size_t j = 0; j < slot.visitCounts.size(); ++j)
+					totalVisitCounts += (unsigned long)slot.visitCounts[j];
 		}
-		else
-			return 0;
+		return totalVisitCounts;
 	}
 	
 	template<typename T>
 	BruteForceSearchOpenCL<T>::BruteForceSearchOpenCL(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const cl_device_type deviceType):
-	OpenCLSearch<T>::OpenCLSearch(cloud, dim, creationOptionFlags, deviceType)
+	OpenCLSearch<T>::OpenCLSearch(cloud, dim, creationOptionFlags, deviceType),
+	partialIndicesCapacity(0),
+	partialDists2Capacity(0)
 	{
 #ifdef EIGEN3_API
 		const_cast<Vector&>(this->minBound) = cloud.topRows(this->dim).rowwise().minCoeff();
@@ -410,7 +468,97 @@ namespace Nabo
 		}
 #endif // EIGEN3_API
 		// init openCL
-		initOpenCL("knn_bf.cl", "knnBruteForce");
+		initOpenCL("knn_bf.cl", "knnBruteForce",
+			(boost::format("#define LARGE_MAX_K %1%\n#define LARGE_K_GROUP_SIZE %2%\n") % MAX_BF_LARGE_K % BF_LARGE_K_GROUP_SIZE).str());
+		
+		// the large-k kernels live in the same program as the single-kernel path
+		partialKernel = cl::Kernel(clProgram, "knnBruteForcePartial");
+		mergeKernel = cl::Kernel(clProgram, "knnBruteForceMerge");
+		partialKernel.setArg(0, sizeof(cl_mem), &cloudCL);
+	}
+	
+	template<typename T>
+	unsigned long BruteForceSearchOpenCL<T>::knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		// the single-kernel path keeps its k-best list in private memory and register
+		// spills collapse its performance beyond MAX_K; larger k run the two-phase
+		// on-device selection instead
+		if (k <= MAX_K)
+			return OpenCLSearch<T>::knn(query, indices, dists2, k, epsilon, optionFlags, maxRadius);
+		return knnLargeK(query, indices, dists2, k, optionFlags, maxRadius);
+	}
+	
+	template<typename T>
+	unsigned long BruteForceSearchOpenCL<T>::knnLargeK(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const unsigned optionFlags, const T maxRadius) const
+	{
+		checkSizesKnn(query, indices, dists2, k);
+		const bool collectStatistics(creationOptionFlags & NearestNeighbourSearch<T>::TOUCH_STATISTICS);
+		
+		// check K
+		if (k > MAX_BF_LARGE_K)
+			throw runtime_error("number of neighbors too large for OpenCL");
+		
+		// check consistency of query wrt cloud
+		if (query.stride() != cloud.stride() ||
+			query.rows() != cloud.rows())
+			throw runtime_error("query is not of the same dimensionality as the point cloud");
+		if (!(query.Flags & Eigen::DirectAccessBit) || (query.Flags & Eigen::RowMajorBit))
+			throw runtime_error("wrong memory mapping in query data");
+		assert((indices.Flags & Eigen::DirectAccessBit) && (!(indices.Flags & Eigen::RowMajorBit)));
+		assert((dists2.Flags & Eigen::DirectAccessBit) && (!(dists2.Flags & Eigen::RowMajorBit)));
+		
+		// number of independent cloud slices scanned per query, enough work groups for full occupancy
+		const cl_uint pointCount(cloud.cols());
+		const cl_uint partCount(min<cl_uint>(64, max<cl_uint>(1, pointCount / (BF_LARGE_K_GROUP_SIZE * 16))));
+		
+		// grow the partial-list scratch, plain device buffers
+		const size_t partialCount(size_t(query.cols()) * partCount * k);
+		growBuffer(partialIndicesCL, partialIndicesCapacity, CL_MEM_READ_WRITE, partialCount * sizeof(int));
+		growBuffer(partialDists2CL, partialDists2Capacity, CL_MEM_READ_WRITE, partialCount * sizeof(T));
+		
+		// map caller matrices, as in the single-kernel path
+		const size_t queryCLSize(query.cols() * query.stride() * sizeof(T));
+		cl::Buffer queryCL(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, queryCLSize, const_cast<T*>(&query.coeff(0,0)));
+		const int indexStride(indices.stride());
+		const size_t indicesCLSize(indices.cols() * indexStride * sizeof(int));
+		cl::Buffer indicesCL(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, indicesCLSize, &indices.coeffRef(0,0));
+		const int dists2Stride(dists2.stride());
+		const size_t dists2CLSize(dists2.cols() * dists2Stride * sizeof(T));
+		cl::Buffer dists2CL(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, dists2CLSize, &dists2.coeffRef(0,0));
+		
+		// phase one: per-work-group partial top k in local memory
+		partialKernel.setArg(1, sizeof(cl_mem), &queryCL);
+		partialKernel.setArg(2, sizeof(cl_mem), &partialIndicesCL);
+		partialKernel.setArg(3, sizeof(cl_mem), &partialDists2CL);
+		partialKernel.setArg(4, cl_uint(k));
+		partialKernel.setArg(5, maxRadius*maxRadius);
+		partialKernel.setArg(6, optionFlags);
+		partialKernel.setArg(7, pointCount);
+		partialKernel.setArg(8, partCount);
+		queue.enqueueNDRangeKernel(partialKernel, cl::NullRange,
+			cl::NDRange(partCount * BF_LARGE_K_GROUP_SIZE, query.cols()),
+			cl::NDRange(BF_LARGE_K_GROUP_SIZE, 1));
+		
+		// phase two: merge the partial lists of each query
+		mergeKernel.setArg(0, sizeof(cl_mem), &partialIndicesCL);
+		mergeKernel.setArg(1, sizeof(cl_mem), &partialDists2CL);
+		mergeKernel.setArg(2, sizeof(cl_mem), &indicesCL);
+		mergeKernel.setArg(3, sizeof(cl_mem), &dists2CL);
+		mergeKernel.setArg(4, cl_uint(k));
+		mergeKernel.setArg(5, partCount);
+		mergeKernel.setArg(6, indexStride);
+		mergeKernel.setArg(7, dists2Stride);
+		queue.enqueueNDRangeKernel(mergeKernel, cl::NullRange,
+			cl::NDRange(query.cols() * BF_LARGE_K_GROUP_SIZE), cl::NDRange(BF_LARGE_K_GROUP_SIZE));
+		queue.enqueueMapBuffer(indicesCL, true, CL_MAP_READ, 0, indicesCLSize, 0, 0);
+		queue.enqueueMapBuffer(dists2CL, true, CL_MAP_READ, 0, dists2CLSize, 0, 0);
+		queue.finish();
+		
+		// brute force touches every point of the cloud once per query
+		if (collectStatistics)
+			return (unsigned long)query.cols() * (unsigned long)pointCount;
+		else
+			return 0;
 	}
 	
 	template struct BruteForceSearchOpenCL<float>;
@@ -35,6 +35,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <limits>
 #include <algorithm>
 #include <stdexcept>
+#include <fstream>
+#include <cstring>
+#ifndef _WIN32
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif // _WIN32
 #include <boost/format.hpp>
 
 /*!	\file nabo.cpp
@@ -46,8 +55,8 @@ namespace Nabo
 {
 	using namespace std;
 	
-	template<typename T>
-	NearestNeighbourSearch<T>::NearestNeighbourSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags):
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>::NearestNeighbourSearch(const Cloud_T& cloud, const Index dim, const unsigned creationOptionFlags):
 		cloud(cloud),
 		dim(min(dim, int(cloud.rows()))),
 		creationOptionFlags(creationOptionFlags),
@@ -60,8 +69,8 @@ namespace Nabo
 			throw runtime_error("Cloud has 0 dimensions");
 	}
 	
-	template<typename T>
-	unsigned long NearestNeighbourSearch<T>::knn(const Vector& query, IndexVector& indices, Vector& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::knn(const Vector& query, IndexVector& indices, Vector& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
 	{
 #ifdef EIGEN3_API
 		const Eigen::Map<const Matrix> queryMatrix(&query.coeff(0,0), dim, 1);
@@ -80,10 +89,10 @@ namespace Nabo
 		return stats;
 	}
 	
-	template<typename T>
-	void NearestNeighbourSearch<T>::checkSizesKnn(const Matrix& query, const IndexMatrix& indices, const Matrix& dists2, const Index k, const unsigned optionFlags, const Vector* maxRadii) const
+	template<typename T, typename Cloud_T>
+	void NearestNeighbourSearch<T, Cloud_T>::checkSizesKnn(const Matrix& query, const IndexMatrix& indices, const Matrix& dists2, const Index k, const unsigned optionFlags, const Vector* maxRadii) const
 	{
-		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T>::ALLOW_SELF_MATCH);
+		const bool allowSelfMatch(optionFlags & NearestNeighbourSearch<T, Cloud_T>::ALLOW_SELF_MATCH);
 		if (allowSelfMatch)
 		{
 			if (k > cloud.cols())
@@ -106,59 +115,670 @@ namespace Nabo
 			throw runtime_error((boost::format("Distance matrix has a different number of columns (%1%) than query (%2%)") % dists2.rows() % query.cols()).str());
 		if (maxRadii && (maxRadii->size() != query.cols()))
 			throw runtime_error((boost::format("Maximum radii vector has not the same length (%1%) than query has columns (%2%)") % maxRadii->size() % k).str());
-		const unsigned maxOptionFlagsValue(ALLOW_SELF_MATCH|SORT_RESULTS);
+		const unsigned maxOptionFlagsValue(ALLOW_SELF_MATCH|SORT_RESULTS|REORDER_QUERIES);
 		if (optionFlags > maxOptionFlagsValue)
 			throw runtime_error((boost::format("OR-ed value of option flags (%1%) is larger than maximal valid value (%2%)") % optionFlags % maxOptionFlagsValue).str());
 	}
 	
+	//! Scratch of the fallback implementation of the context-based query path
+	/*!	Holds the one-column result matrices the single-point knn() otherwise materializes on every call. */
+	template<typename T, typename Cloud_T>
+	struct MatrixScratchContext: public NearestNeighbourSearch<T, Cloud_T>::SearchContext
+	{
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Index Index;
+		
+		IndexMatrix indexMatrix; //!< scratch for the result indices
+		Matrix dists2Matrix; //!< scratch for the result squared distances
+		
+		//! constructor, allocates the scratch for k neighbours
+		MatrixScratchContext(const Index k): indexMatrix(k, 1), dists2Matrix(k, 1) {}
+	};
+	
+	template<typename T, typename Cloud_T>
+	typename NearestNeighbourSearch<T, Cloud_T>::SearchContext* NearestNeighbourSearch<T, Cloud_T>::createSearchContext(const Index k) const
+	{
+		return new MatrixScratchContext<T, Cloud_T>(k);
+	}
+	
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::knn(SearchContext& context, const Vector& query, IndexVector& indices, Vector& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		MatrixScratchContext<T, Cloud_T>* ctx(dynamic_cast<MatrixScratchContext<T, Cloud_T>*>(&context));
+		if (!ctx)
+			throw runtime_error("Search context was not created by createSearchContext() of this search");
+		if (ctx->indexMatrix.rows() != k)
+		{
+			ctx->indexMatrix.resize(k, 1);
+			ctx->dists2Matrix.resize(k, 1);
+		}
+#ifdef EIGEN3_API
+		const Eigen::Map<const Matrix> queryMatrix(&query.coeff(0,0), dim, 1);
+#else // EIGEN3_API
+		const Eigen::Map<Matrix> queryMatrix(&query.coeff(0,0), dim, 1);
+#endif // EIGEN3_API
+		const unsigned long stats = knn(queryMatrix, ctx->indexMatrix, ctx->dists2Matrix, k, epsilon, optionFlags, maxRadius);
+		indices = ctx->indexMatrix.col(0);
+		dists2 = ctx->dists2Matrix.col(0);
+		return stats;
+	}
+	
+	//! Private implementation of AsyncQuery, holding the thread and the outcome of the query
+	struct AsyncQuery::Impl
+	{
+		#ifndef _WIN32
+		pthread_t thread; //!< thread answering the query
+		#endif // _WIN32
+		unsigned long result; //!< value knn() returned
+		std::string error; //!< what() of the exception thrown by knn(), if any
+		bool hasError; //!< whether knn() threw an exception
+		bool joined; //!< whether the thread has been joined already
+
+		//! create an implementation with no outcome yet
+		Impl(): result(0), hasError(false), joined(false) {}
+		virtual ~Impl() {}
+		//! run the query, called on the background thread
+		virtual unsigned long run() = 0;
+	};
+
+	//! \ingroup private
+	//@{
+
+	//! Typed closure around a knn() call, so that AsyncQuery::Impl can stay untemplatized
+	template<typename T, typename Cloud_T>
+	struct KnnAsyncImpl: public AsyncQuery::Impl
+	{
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Index Index;
+
+		const NearestNeighbourSearch<T, Cloud_T>* nns; //!< object to query
+		const Matrix& query; //!< query points
+		IndexMatrix& indices; //!< indices of nearest neighbours
+		Matrix& dists2; //!< squared distances to nearest neighbours
+		const Index k; //!< number of nearest neighbour requested
+		const T epsilon; //!< maximal ratio of error for approximate search
+		const unsigned optionFlags; //!< search options
+		const T maxRadius; //!< maximum radius in which to search
+
+		//! create a closure around the given knn() arguments
+		KnnAsyncImpl(const NearestNeighbourSearch<T, Cloud_T>* nns, const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius):
+			nns(nns), query(query), indices(indices), dists2(dists2), k(k), epsilon(epsilon), optionFlags(optionFlags), maxRadius(maxRadius)
+		{}
+
+		virtual unsigned long run()
+		{
+			return nns->knn(query, indices, dists2, k, epsilon, optionFlags, maxRadius);
+		}
+	};
+
+	//! Thread entry point running an AsyncQuery::Impl and capturing its outcome
+	/** \param arg pointer to the implementation to run
+	 * \return 0
+	 */
+	static void* runAsyncQuery(void* arg)
+	{
+		AsyncQuery::Impl* impl(reinterpret_cast<AsyncQuery::Impl*>(arg));
+		try
+		{
+			impl->result = impl->run();
+		}
+		catch (const std::exception& e)
+		{
+			impl->error = e.what();
+			impl->hasError = true;
+		}
+		return 0;
+	}
+
+	//@}
+
+	AsyncQuery::AsyncQuery(Impl* impl):
+		impl(impl)
+	{
+		#ifndef _WIN32
+		const int ret(pthread_create(&impl->thread, 0, runAsyncQuery, impl));
+		if (ret != 0)
+		{
+			delete impl;
+			throw runtime_error((boost::format("Cannot create thread for asynchronous query (error %1%)") % ret).str());
+		}
+		#else // _WIN32
+		// no thread support on this platform, run synchronously
+		runAsyncQuery(impl);
+		impl->joined = true;
+		#endif // _WIN32
+	}
+
+	unsigned long AsyncQuery::wait()
+	{
+		#ifndef _WIN32
+		if (!impl->joined)
+		{
+			pthread_join(impl->thread, 0);
+			impl->joined = true;
+		}
+		#endif // _WIN32
+		if (impl->hasError)
+			throw runtime_error(impl->error);
+		return impl->result;
+	}
+
+	AsyncQuery::~AsyncQuery()
+	{
+		#ifndef _WIN32
+		if (!impl->joined)
+			pthread_join(impl->thread, 0);
+		#endif // _WIN32
+		delete impl;
+	}
+
+	template<typename T, typename Cloud_T>
+	AsyncQuery* NearestNeighbourSearch<T, Cloud_T>::knnAsync(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		return new AsyncQuery(new KnnAsyncImpl<T, Cloud_T>(this, query, indices, dists2, k, epsilon, optionFlags, maxRadius));
+	}
+
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags) const
+	{
+		if (query.size() < dim)
+			throw runtime_error((boost::format("Query has less dimensions (%1%) than requested for cloud (%2%)") % query.size() % dim).str());
+		const bool allowSelfMatch(optionFlags & ALLOW_SELF_MATCH);
+		const bool sortResults(optionFlags & SORT_RESULTS);
+		const T radius2(radius * radius);
+
+		indices.clear();
+		dists2.clear();
+		const Vector& q(query.block(0, 0, dim, 1));
+		for (int i = 0; i < cloud.cols(); ++i)
+		{
+			const T dist(dist2<T>(cloud.block(0, i, dim, 1), q));
+			if ((dist <= radius2) &&
+				(allowSelfMatch || (dist > numeric_limits<T>::epsilon())))
+			{
+				indices.push_back(i);
+				dists2.push_back(dist);
+			}
+		}
+		if (sortResults)
+			sortRadiusResults(indices, dists2);
+		return indices.size();
+	}
+
+	template<typename T, typename Cloud_T>
+	void NearestNeighbourSearch<T, Cloud_T>::addPoints(const Matrix& newPoints)
+	{
+		throw runtime_error((boost::format("Adding points is not supported for this search type (%1% points given)") % newPoints.cols()).str());
+	}
+
+	template<typename T, typename Cloud_T>
+	void NearestNeighbourSearch<T, Cloud_T>::removePoints(const IndexVector& indices)
+	{
+		throw runtime_error((boost::format("Removing points is not supported for this search type (%1% indices given)") % indices.size()).str());
+	}
+
+	//! \ingroup private
+	//! return the recall of a search at a given epsilon, as the fraction of returned neighbours at most as far as the per-query exact k-th distance
+	template<typename T, typename Cloud_T>
+	double epsilonRecall(const NearestNeighbourSearch<T, Cloud_T>& search, const typename NearestNeighbourSearch<T, Cloud_T>::Matrix& sampleQueries, const typename NearestNeighbourSearch<T, Cloud_T>::Vector& worstExact, const size_t validCount, const int k, const T epsilon, const unsigned optionFlags)
+	{
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		const int colCount(sampleQueries.cols());
+		IndexMatrix indices(k, colCount);
+		Matrix dists2(k, colCount);
+		search.knn(sampleQueries, indices, dists2, k, epsilon, optionFlags);
+		const T inf(numeric_limits<T>::infinity());
+		size_t matchCount(0);
+		for (int i = 0; i < colCount; ++i)
+			for (int j = 0; j < k; ++j)
+				if (dists2(j, i) != inf && dists2(j, i) <= worstExact[i])
+					++matchCount;
+		return double(matchCount) / double(validCount);
+	}
+
+	template<typename T, typename Cloud_T>
+	T NearestNeighbourSearch<T, Cloud_T>::calibrateEpsilon(const Matrix& sampleQueries, const Index k, const T targetRecall, const unsigned optionFlags, const T maxEpsilon) const
+	{
+		if (sampleQueries.cols() == 0)
+			throw runtime_error("Epsilon calibration requires at least one sample query");
+		if (targetRecall <= 0 || targetRecall > 1)
+			throw runtime_error((boost::format("Target recall %1% is outside of (0, 1]") % targetRecall).str());
+		if (maxEpsilon < 0)
+			throw runtime_error((boost::format("Maximum epsilon %1% is negative") % maxEpsilon).str());
+
+		// exact reference pass: per query, the distance of the k-th exact neighbour, against
+		// which candidates count as hits; comparing distances rather than indices keeps ties harmless
+		const int colCount(sampleQueries.cols());
+		IndexMatrix indices(k, colCount);
+		Matrix dists2(k, colCount);
+		knn(sampleQueries, indices, dists2, k, 0, optionFlags);
+		const T inf(numeric_limits<T>::infinity());
+		Vector worstExact(colCount);
+		size_t validCount(0);
+		for (int i = 0; i < colCount; ++i)
+		{
+			T worst(0);
+			for (int j = 0; j < int(k); ++j)
+			{
+				if (dists2(j, i) == inf)
+					continue;
+				worst = max(worst, dists2(j, i));
+				++validCount;
+			}
+			worstExact[i] = worst;
+		}
+		if (validCount == 0)
+			throw runtime_error("Epsilon calibration found no exact neighbours for the sample queries");
+
+		// recall does not increase with epsilon, so binary-search the largest admissible value
+		if (epsilonRecall(*this, sampleQueries, worstExact, validCount, k, maxEpsilon, optionFlags) >= double(targetRecall))
+			return maxEpsilon;
+		T lo(0), hi(maxEpsilon);
+		for (int iteration = 0; iteration < 16; ++iteration)
+		{
+			const T mid((lo + hi) / 2);
+			if (epsilonRecall(*this, sampleQueries, worstExact, validCount, k, mid, optionFlags) >= double(targetRecall))
+				lo = mid;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::knnWarmStart(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& warmRadii, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		checkSizesKnn(query, indices, dists2, k, optionFlags, &warmRadii);
+		const T inf(std::numeric_limits<T>::infinity());
+		
+		// first pass, pruned with the hints
+		Vector radii(query.cols());
+		for (int i = 0; i < query.cols(); ++i)
+			radii(i) = std::min(warmRadii(i), maxRadius);
+		unsigned long touchCount(knn(query, indices, dists2, radii, k, epsilon, optionFlags));
+		
+		// second pass without the hints, only for the queries whose hint cut the result short
+		std::vector<int> retries;
+		for (int i = 0; i < query.cols(); ++i)
+			if ((radii(i) < maxRadius) && (dists2.col(i).array() == inf).any())
+				retries.push_back(i);
+		if (!retries.empty())
+		{
+			Matrix retryQuery(query.rows(), retries.size());
+			for (size_t i = 0; i < retries.size(); ++i)
+				retryQuery.col(i) = query.col(retries[i]);
+			IndexMatrix retryIndices(k, retries.size());
+			Matrix retryDists2(k, retries.size());
+			touchCount += knn(retryQuery, retryIndices, retryDists2, k, epsilon, optionFlags, maxRadius);
+			for (size_t i = 0; i < retries.size(); ++i)
+			{
+				indices.col(retries[i]) = retryIndices.col(i);
+				dists2.col(retries[i]) = retryDists2.col(i);
+			}
+		}
+		return touchCount;
+	}
+	
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::knnWarmStartFromPrior(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Matrix& priorDists2, const T motionBound, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		if (priorDists2.rows() != k)
+			throw runtime_error((boost::format("Prior distance matrix has a different number of rows (%1%) than k (%2%)") % priorDists2.rows() % k).str());
+		if (priorDists2.cols() != query.cols())
+			throw runtime_error((boost::format("Prior distance matrix has a different number of columns (%1%) than query (%2%)") % priorDists2.cols() % query.cols()).str());
+		const T inf(std::numeric_limits<T>::infinity());
+		
+		Vector warmRadii(query.cols());
+		for (int i = 0; i < query.cols(); ++i)
+		{
+			const T kthDist2(priorDists2.col(i).maxCoeff());
+			if (kthDist2 == inf)
+				warmRadii(i) = inf;
+			else
+				warmRadii(i) = sqrt(kthDist2) + 2*motionBound;
+		}
+		return knnWarmStart(query, indices, dists2, warmRadii, k, epsilon, optionFlags, maxRadius);
+	}
 	
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::selfKnn(IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		// the reference binds the cloud directly when it is a plain matrix,
+		// and a temporary copy when it is mapped from external storage
+		const Matrix& query(cloud);
+		return knn(query, indices, dists2, k, epsilon, optionFlags, maxRadius);
+	}
+
+	template<typename T, typename Cloud_T>
+	unsigned long NearestNeighbourSearch<T, Cloud_T>::knn(const Matrix& query, ResultSink& sink, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const
+	{
+		// answer the batch in bounded blocks through the matrix version, so the intermediate
+		// result storage stays small no matter how many queries are streamed
+		const Index blockSize(1024);
+		const Index colCount(query.cols());
+		unsigned long touchCount(0);
+		for (Index start = 0; start < colCount; start += blockSize)
+		{
+			const Index count(min(blockSize, colCount - start));
+			const Matrix queryBlock(query.block(0, start, query.rows(), count));
+			IndexMatrix indices(k, count);
+			Matrix dists2(k, count);
+			touchCount += knn(queryBlock, indices, dists2, k, epsilon, optionFlags, maxRadius);
+			for (Index i = 0; i < count; ++i)
+				sink.onQueryDone(start + i, k, &indices.coeffRef(0, i), &dists2.coeffRef(0, i));
+		}
+		return touchCount;
+	}
+
+	template<typename T, typename Cloud_T>
+	typename NearestNeighbourSearch<T, Cloud_T>::IndexVector NearestNeighbourSearch<T, Cloud_T>::getLeafOrder() const
+	{
+		throw runtime_error("Returning the leaf order is not supported for this search type");
+	}
+
+	template<typename T, typename Cloud_T>
+	void NearestNeighbourSearch<T, Cloud_T>::rebuild()
+	{
+		throw runtime_error("Rebuilding is not supported for this search type");
+	}
+
+	template<typename T, typename Cloud_T>
+	void NearestNeighbourSearch<T, Cloud_T>::save(const std::string& fileName) const
+	{
+		throw runtime_error((boost::format("Saving is not supported for this search type (file %1% not written)") % fileName).str());
+	}
+
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* NearestNeighbourSearch<T, Cloud_T>::load(const Cloud_T& cloud, const std::string& fileName, const unsigned creationOptionFlags)
+	{
+		ifstream ifs(fileName.c_str(), ios::binary);
+		if (!ifs.good())
+			throw runtime_error((boost::format("Cannot open file %1% for reading") % fileName).str());
+		KDTreeFileHeader fileHeader;
+		ifs.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+		if (!ifs.good() || memcmp(fileHeader.magic, "NABOTREE", 8) != 0)
+			throw runtime_error((boost::format("File %1% is not a nabo tree dump") % fileName).str());
+		if (fileHeader.version != 1 && fileHeader.version != 2)
+			throw runtime_error((boost::format("File %1% has unsupported version %2%") % fileName % fileHeader.version).str());
+		if (fileHeader.scalarSize != sizeof(T))
+			throw runtime_error((boost::format("File %1% was saved with a scalar size of %2% bytes, but %3% bytes were requested") % fileName % fileHeader.scalarSize % sizeof(T)).str());
+		if (fileHeader.pointCount != uint64_t(cloud.cols()))
+			throw runtime_error((boost::format("File %1% was saved with %2% points, but the given cloud has %3% points") % fileName % fileHeader.pointCount % cloud.cols()).str());
+		switch (fileHeader.searchType)
+		{
+			case KDTREE_LINEAR_HEAP:
+			case KDTREE_TREE_HEAP:
+				if (fileHeader.version == 2)
+					return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapAuto<int,T>, Cloud_T, uint64_t>(cloud, creationOptionFlags, fileHeader, ifs);
+				return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapAuto<int,T>, Cloud_T>(cloud, creationOptionFlags, fileHeader, ifs);
+			default: throw runtime_error((boost::format("File %1% was saved with search type %2%, which does not support loading") % fileName % fileHeader.searchType).str());
+		}
+	}
+
+	//! \ingroup private
+	//@{
+
+	//! Creator for the search types that only exist over plain-matrix clouds
+	/** KDTreeDynamic presents the growable copy of the cloud it owns as a plain matrix,
+	 *	and the OpenCL searches map their cloud assuming one; searches typed on another
+	 *	cloud type therefore cannot provide these search types. */
+	template<typename T, typename Cloud_T>
+	struct PlainCloudSearchCreator
+	{
+		//! fail, see the class documentation
+		static NearestNeighbourSearch<T, Cloud_T>* create(const Cloud_T&, const int, const int, const unsigned, const Parameters&)
+		{
+			throw runtime_error("This search type requires the cloud to be a plain Eigen matrix");
+		}
+	};
+
+	//! Specialization for plain-matrix clouds, doing the actual creation
 	template<typename T>
-	NearestNeighbourSearch<T>* NearestNeighbourSearch<T>::create(const Matrix& cloud, const Index dim, const SearchType preferedType, const unsigned creationOptionFlags, const Parameters& additionalParameters)
+	struct PlainCloudSearchCreator<T, Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >
+	{
+		//! the plain-matrix cloud type
+		typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+
+		//! create the search of the given type, parameters are those of NearestNeighbourSearch::create()
+		static NearestNeighbourSearch<T>* create(const Matrix& cloud, const int searchType, const int dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
+		{
+			switch (searchType)
+			{
+				#ifdef HAVE_OPENCL
+				case NearestNeighbourSearch<T>::KDTREE_CL_PT_IN_NODES: return new KDTreeBalancedPtInNodesStackOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
+				case NearestNeighbourSearch<T>::KDTREE_CL_PT_IN_LEAVES: return new KDTreeBalancedPtInLeavesStackOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
+				case NearestNeighbourSearch<T>::BRUTE_FORCE_CL: return new BruteForceSearchOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
+				#endif // HAVE_OPENCL
+				case NearestNeighbourSearch<T>::KDTREE_DYNAMIC: return new KDTreeDynamic<T, IndexHeapBruteForceVector<int,T> >(cloud, dim, creationOptionFlags, additionalParameters);
+				default: throw runtime_error("Unknown search type");
+			}
+		}
+	};
+
+	//! Create the static kd-tree over a cloud, widening the packed node indices to 64 bits when the node-count estimate overflows the default 32-bit packing, or when the largeNodeIndices creation parameter is set
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* createKDTree(const Cloud_T& cloud, const typename NearestNeighbourSearch<T, Cloud_T>::Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
+	{
+		const unsigned bucketSize(additionalParameters.get<unsigned>("bucketSize", 8));
+		if (additionalParameters.get<unsigned>("largeNodeIndices", 0) != 0 ||
+			kdTreeNeedsLargeNodeIndices(cloud.cols(), std::min<int>(dim, cloud.rows()), bucketSize))
+			return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapAuto<int,T>, Cloud_T, uint64_t>(cloud, dim, creationOptionFlags, additionalParameters);
+		return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapAuto<int,T>, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
+	}
+
+	//@}
+
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* NearestNeighbourSearch<T, Cloud_T>::create(const Cloud_T& cloud, const Index dim, const SearchType preferedType, const unsigned creationOptionFlags, const Parameters& additionalParameters)
 	{
 		if (dim <= 0)
 			throw runtime_error("Your space must have at least one dimension");
 		switch (preferedType)
 		{
-			case BRUTE_FORCE: return new BruteForceSearch<T>(cloud, dim, creationOptionFlags);
-			case KDTREE_LINEAR_HEAP: return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapBruteForceVector<int,T> >(cloud, dim, creationOptionFlags, additionalParameters);
-			case KDTREE_TREE_HEAP: return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapSTL<int,T> >(cloud, dim, creationOptionFlags, additionalParameters);
+			case BRUTE_FORCE: return new BruteForceSearch<T, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
+			case KDTREE_LINEAR_HEAP: return createKDTree<T, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
+			case KDTREE_TREE_HEAP: return createKDTree<T, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
 			#ifdef HAVE_OPENCL
-			case KDTREE_CL_PT_IN_NODES: return new KDTreeBalancedPtInNodesStackOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
-			case KDTREE_CL_PT_IN_LEAVES: return new KDTreeBalancedPtInLeavesStackOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
-			case BRUTE_FORCE_CL: return new BruteForceSearchOpenCL<T>(cloud, dim, creationOptionFlags, CL_DEVICE_TYPE_GPU);
+			case KDTREE_CL_PT_IN_NODES:
+			case KDTREE_CL_PT_IN_LEAVES:
+			case BRUTE_FORCE_CL:
+				return PlainCloudSearchCreator<T, Cloud_T>::create(cloud, preferedType, dim, creationOptionFlags, additionalParameters);
 			#else // HAVE_OPENCL
 			case KDTREE_CL_PT_IN_NODES: throw runtime_error("OpenCL not found during compilation");
 			case KDTREE_CL_PT_IN_LEAVES: throw runtime_error("OpenCL not found during compilation");
 			case BRUTE_FORCE_CL: throw runtime_error("OpenCL not found during compilation");
 			#endif // HAVE_OPENCL
+			case KDTREE_DYNAMIC:
+				return PlainCloudSearchCreator<T, Cloud_T>::create(cloud, preferedType, dim, creationOptionFlags, additionalParameters);
+			case KDTREE_FOREST: return new KDTreeForest<T, IndexHeapAuto<int,T>, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
 			default: throw runtime_error("Unknown search type");
 		}
 	}
 	
-	template<typename T>
-	NearestNeighbourSearch<T>* NearestNeighbourSearch<T>::createBruteForce(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags)
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* NearestNeighbourSearch<T, Cloud_T>::createBruteForce(const Cloud_T& cloud, const Index dim, const unsigned creationOptionFlags)
 	{
 		if (dim <= 0)
 			throw runtime_error("Your space must have at least one dimension");
-		return new BruteForceSearch<T>(cloud, dim, creationOptionFlags);
+		return new BruteForceSearch<T, Cloud_T>(cloud, dim, creationOptionFlags);
 	}
 	
-	template<typename T>
-	NearestNeighbourSearch<T>* NearestNeighbourSearch<T>::createKDTreeLinearHeap(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* NearestNeighbourSearch<T, Cloud_T>::createKDTreeLinearHeap(const Cloud_T& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
 	{
 		if (dim <= 0)
 			throw runtime_error("Your space must have at least one dimension");
-		return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapBruteForceVector<int,T> >(cloud, dim, creationOptionFlags, additionalParameters);
+		return createKDTree<T, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
 	}
 	
-	template<typename T>
-	NearestNeighbourSearch<T>* NearestNeighbourSearch<T>::createKDTreeTreeHeap(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
+	template<typename T, typename Cloud_T>
+	NearestNeighbourSearch<T, Cloud_T>* NearestNeighbourSearch<T, Cloud_T>::createKDTreeTreeHeap(const Cloud_T& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters)
 	{
 		if (dim <= 0)
 			throw runtime_error("Your space must have at least one dimension");
-		return new KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, IndexHeapSTL<int,T> >(cloud, dim, creationOptionFlags, additionalParameters);
+		return createKDTree<T, Cloud_T>(cloud, dim, creationOptionFlags, additionalParameters);
 	}
 	
+	template<typename T>
+	void saveCloudFile(const std::string& fileName, const typename NearestNeighbourSearch<T>::Matrix& cloud)
+	{
+		ofstream ofs(fileName.c_str(), ios::binary);
+		if (!ofs.good())
+			throw runtime_error((boost::format("Cannot open file %1% for writing") % fileName).str());
+		CloudFileHeader header;
+		memcpy(header.magic, "NABOCLD1", 8);
+		header.scalarSize = sizeof(T);
+		header.dim = cloud.rows();
+		header.pointCount = cloud.cols();
+		header.reserved = 0;
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(cloud.data()), size_t(cloud.rows()) * cloud.cols() * sizeof(T));
+		if (!ofs.good())
+			throw runtime_error((boost::format("Error while writing cloud file %1%") % fileName).str());
+	}
+
+	template<typename T>
+	typename NearestNeighbourSearch<T>::Matrix loadCloudFile(const std::string& fileName)
+	{
+		const CloudFileHeader header(readCloudFileHeader(fileName, sizeof(T)));
+		ifstream ifs(fileName.c_str(), ios::binary);
+		ifs.seekg(sizeof(header));
+		typename NearestNeighbourSearch<T>::Matrix cloud(header.dim, header.pointCount);
+		ifs.read(reinterpret_cast<char*>(cloud.data()), size_t(header.dim) * header.pointCount * sizeof(T));
+		if (!ifs.good())
+			throw runtime_error((boost::format("Unexpected end of stream while reading cloud file %1%") % fileName).str());
+		return cloud;
+	}
+
+	template void saveCloudFile<float>(const std::string&, const NearestNeighbourSearch<float>::Matrix&);
+	template void saveCloudFile<double>(const std::string&, const NearestNeighbourSearch<double>::Matrix&);
+	template NearestNeighbourSearch<float>::Matrix loadCloudFile<float>(const std::string&);
+	template NearestNeighbourSearch<double>::Matrix loadCloudFile<double>(const std::string&);
+
+#ifdef EIGEN3_API
+	//! \ingroup private
+	//@{
+
+	//! return the size in bytes of a cloud file, validating it holds at least one whole point of scalar size scalarSize and dimension dim
+	size_t cloudFileByteCount(const std::string& fileName, const int dim, const size_t scalarSize)
+	{
+#ifndef _WIN32
+		struct stat st;
+		if (stat(fileName.c_str(), &st) != 0)
+			throw runtime_error((boost::format("Cannot stat cloud file %1%") % fileName).str());
+		const size_t byteCount(st.st_size);
+		const size_t pointSize(dim * scalarSize);
+		if (dim <= 0)
+			throw runtime_error("Your space must have at least one dimension");
+		if (byteCount == 0 || byteCount % pointSize != 0)
+			throw runtime_error((boost::format("Cloud file %1% has %2% bytes, not a non-zero multiple of the %3%-byte point size") % fileName % byteCount % pointSize).str());
+		return byteCount;
+#else // _WIN32
+		throw runtime_error((boost::format("Memory-mapped cloud files are not supported on this platform (file %1%)") % fileName).str());
+#endif // _WIN32
+	}
+
+	CloudFileHeader readCloudFileHeader(const std::string& fileName, const size_t scalarSize)
+	{
+		ifstream ifs(fileName.c_str(), ios::binary);
+		if (!ifs.good())
+			throw runtime_error((boost::format("Cannot open cloud file %1% for reading") % fileName).str());
+		CloudFileHeader header;
+		ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!ifs.good() || memcmp(header.magic, "NABOCLD1", 8) != 0)
+			throw runtime_error((boost::format("File %1% is not a nabo cloud file") % fileName).str());
+		if (header.scalarSize != scalarSize)
+			throw runtime_error((boost::format("Cloud file %1% was saved with a scalar size of %2% bytes, but %3% bytes were requested") % fileName % header.scalarSize % scalarSize).str());
+		if (header.dim == 0 || header.pointCount == 0)
+			throw runtime_error((boost::format("Cloud file %1% announces an empty cloud (%2% x %3%)") % fileName % header.dim % header.pointCount).str());
+		ifs.seekg(0, ios::end);
+		const uint64_t byteCount(ifs.tellg());
+		if (byteCount != sizeof(header) + header.pointCount * header.dim * scalarSize)
+			throw runtime_error((boost::format("Cloud file %1% has %2% bytes, but its header announces %3% points of dimension %4%") % fileName % byteCount % header.pointCount % header.dim).str());
+		return header;
+	}
+
+	//! open a cloud file read-only, throwing when it cannot be opened
+	int openCloudFile(const std::string& fileName)
+	{
+#ifndef _WIN32
+		const int fd(open(fileName.c_str(), O_RDONLY));
+		if (fd < 0)
+			throw runtime_error((boost::format("Cannot open cloud file %1% for reading") % fileName).str());
+		return fd;
+#else // _WIN32
+		throw runtime_error((boost::format("Memory-mapped cloud files are not supported on this platform (file %1%)") % fileName).str());
+#endif // _WIN32
+	}
+
+	//! map byteCount bytes of an open cloud file read-only, closing the file and throwing on failure
+	const void* mapCloudFile(const int fd, const size_t byteCount, const std::string& fileName)
+	{
+#ifndef _WIN32
+		const void* data(mmap(0, byteCount, PROT_READ, MAP_SHARED, fd, 0));
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			throw runtime_error((boost::format("Cannot memory-map cloud file %1%") % fileName).str());
+		}
+		return data;
+#else // _WIN32
+		throw runtime_error((boost::format("Memory-mapped cloud files are not supported on this platform (file %1%)") % fileName).str());
+#endif // _WIN32
+	}
+
+	//@}
+
+	template<typename T>
+	MappedCloudFile<T>::MappedCloudFile(const std::string& fileName, const int dim):
+		byteCount(cloudFileByteCount(fileName, dim, sizeof(T))),
+		fd(openCloudFile(fileName)),
+		data(mapCloudFile(fd, byteCount, fileName)),
+		cloud(reinterpret_cast<const T*>(data), dim, byteCount / (dim * sizeof(T)))
+	{
+	}
+
+	//! \ingroup private
+	//! return the size in bytes of a cloud file with a header, after validating the header for the given scalar size
+	size_t headedCloudFileByteCount(const std::string& fileName, const size_t scalarSize)
+	{
+		const CloudFileHeader header(readCloudFileHeader(fileName, scalarSize));
+		return sizeof(header) + header.pointCount * header.dim * scalarSize;
+	}
+
+	template<typename T>
+	MappedCloudFile<T>::MappedCloudFile(const std::string& fileName):
+		byteCount(headedCloudFileByteCount(fileName, sizeof(T))),
+		fd(openCloudFile(fileName)),
+		data(mapCloudFile(fd, byteCount, fileName)),
+		cloud(reinterpret_cast<const T*>(reinterpret_cast<const char*>(data) + sizeof(CloudFileHeader)),
+			reinterpret_cast<const CloudFileHeader*>(data)->dim,
+			reinterpret_cast<const CloudFileHeader*>(data)->pointCount)
+	{
+	}
+
+	template<typename T>
+	MappedCloudFile<T>::~MappedCloudFile()
+	{
+#ifndef _WIN32
+		munmap(const_cast<void*>(data), byteCount);
+		close(fd);
+#endif // _WIN32
+	}
+
+	template struct MappedCloudFile<float>;
+	template struct MappedCloudFile<double>;
+#endif // EIGEN3_API
+
 	template struct NearestNeighbourSearch<float>;
 	template struct NearestNeighbourSearch<double>;
+#ifdef EIGEN3_API
+	template struct NearestNeighbourSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct NearestNeighbourSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> >;
+	template struct NearestNeighbourSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+	template struct NearestNeighbourSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > >;
+#endif // EIGEN3_API
 }
@@ -127,6 +127,29 @@ Note that the matrix-based interface for query is more efficient than the vector
 
 The following additional construction parameters are available in KDTREE_ algorithms:
 - \c bucketSize (\c unsigned): bucket size, defaults to 8
+- \c buildParallelism (\c unsigned): number of threads used to build the tree, 0 for one per core, defaults to 1 (serial build); only effective if libnabo was compiled with OpenMP support
+- \c maxThreads (\c unsigned): maximum number of threads used to answer batch queries, 0 for the OpenMP default, defaults to 0; allows capping the threads of a given tree independently of the global OpenMP state
+- \c soaBuckets (\c unsigned): if non-zero, copy bucket coordinates into a contiguous structure-of-arrays block to speed up leaf scans, defaults to 0
+- \c nodeLayout (\c unsigned): if 1, reorder the tree nodes after construction into a breadth-blocked layout that keeps the upper levels of the tree contiguous in memory, defaults to 0 (depth-first layout)
+- \c maxLeafVisited (\c unsigned): if non-zero, answer queries with a best-bin-first traversal that visits subtrees in order of their distance to the query and stops after scanning that many buckets, returning the best neighbours found so far; bounds the worst-case cost of a query, defaults to 0 (exhaustive depth-first traversal)
+- \c quantizedBuckets (\c unsigned): if non-zero, store bucket coordinates quantized to 16 bits relative to the cloud bounds and scan those instead of the full-precision points, refining candidates against the cloud only when needed; results stay exact, defaults to 0
+- \c largeNodeIndices (\c unsigned): if non-zero, pack the node indices of the tree into 64 bits instead of 32, lifting the node-count limit for billion-point clouds at the price of larger nodes; selected automatically when the node-count estimate overflows the 32-bit packing, defaults to 0
+
+The following additional construction parameters are available in the KDTREE_FOREST algorithm, in addition to the KDTREE_ ones, which are forwarded to the per-shard trees:
+- \c shardCount (\c unsigned): number of spatial shards, each holding its own tree; 0 for one per core, defaults to 0
+
+The following additional construction parameters are available in the BRUTE_FORCE algorithm:
+- \c gemmBlockSize (\c unsigned): if non-zero, answer batch queries tile by tile using matrix products over blocks of that many queries and cloud points (256 is a good value), instead of scanning point pairs one at a time, defaults to 0
+
+\section OutOfCore Out-of-core clouds
+
+Clouds larger than RAM can be searched by memory-mapping them from a file with MappedCloudFile and
+building the tree over its \c cloud member; the tree buckets reference the mapped points in place,
+so only the tree itself has to fit in memory and the operating system pages cloud data in and out as
+queries touch it. For the best page locality, build a first tree, rewrite the file with the points in
+NearestNeighbourSearch::getLeafOrder() order, and rebuild over the reordered file: every leaf visit
+then reads one contiguous run of the file, which the page cache serves well for spatially coherent
+query streams.
 
 \section UnitTesting Unit testing
 
@@ -240,14 +263,41 @@ namespace Nabo
 		}
 	};
 	
-	//! Nearest neighbour search interface, templatized on scalar type
-	template<typename T>
+	//! Handle on an asynchronous batch query started by NearestNeighbourSearch::knnAsync()
+	/*! The destructor waits for the query to complete if wait() has not been called. */
+	struct AsyncQuery
+	{
+		//! \cond INTERNAL
+		struct Impl;
+		//! create a handle around an implementation, used by knnAsync() only
+		AsyncQuery(Impl* impl);
+		//! \endcond
+
+		//! Wait for the query to complete; the result matrices are valid once this returns
+		/*!	If the query threw an exception, it is rethrown here.
+		 *	\return the value knn() would have returned */
+		unsigned long wait();
+		//! destructor, waits for the query to complete
+		~AsyncQuery();
+
+	private:
+		Impl* impl; //!< private implementation, hides the threading details
+	};
+
+	//! Nearest neighbour search interface, templatized on scalar type and on the type of the data-point cloud
+	/*!	Cloud_T is an Eigen expression with direct column-major access to the points, one per column.
+	 *	Besides the default plain matrix, it can be an Eigen::Map over external storage such as a
+	 *	shared-memory segment or a memory-mapped file, possibly with an Eigen::OuterStride when points
+	 *	are padded; the search then indexes that storage in place, without copying the cloud. */
+	template<typename T, typename Cloud_T = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >
 	struct NearestNeighbourSearch
 	{
 		//! an Eigen vector of type T, to hold the coordinates of a point
 		typedef typename Eigen::Matrix<T, Eigen::Dynamic, 1> Vector; 
 		//! a column-major Eigen matrix in which each column is a point; this matrix has dim rows
 		typedef typename Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+		//! the type holding the data-point cloud, see the class documentation
+		typedef Cloud_T CloudType;
 		//! an index to a Vector or a Matrix, for refering to data points
 		typedef int Index;
 		//! a vector of indices to data points
@@ -256,7 +306,7 @@ namespace Nabo
 		typedef typename Eigen::Matrix<Index, Eigen::Dynamic, Eigen::Dynamic> IndexMatrix;
 		
 		//! the reference to the data-point cloud, which must remain valid during the lifetime of the NearestNeighbourSearch object
-		const Matrix& cloud;
+		const CloudType& cloud;
 		//! the dimensionality of the data-point cloud
 		const Index dim;
 		//! creation options
@@ -270,11 +320,13 @@ namespace Nabo
 		enum SearchType
 		{
 			BRUTE_FORCE = 0, //!< brute force, check distance to every point in the data
-			KDTREE_LINEAR_HEAP, //!< kd-tree with linear heap, good for small k (~up to 30)
-			KDTREE_TREE_HEAP, //!< kd-tree with tree heap, good for large k (~from 30)
+			KDTREE_LINEAR_HEAP, //!< kd-tree, now selects the candidate-list implementation from the requested k at query time (inline sorted list for small k, binary heap beyond); kept distinct from KDTREE_TREE_HEAP for API compatibility
+			KDTREE_TREE_HEAP, //!< kd-tree, behaves as KDTREE_LINEAR_HEAP since the candidate list is selected from k at query time
 			KDTREE_CL_PT_IN_NODES, //!< kd-tree using openCL, pt in nodes, only available if OpenCL enabled, UNSTABLE API
 			KDTREE_CL_PT_IN_LEAVES, //!< kd-tree using openCL, pt in leaves, only available if OpenCL enabled, UNSTABLE API
 			BRUTE_FORCE_CL, //!< brute-force using openCL, only available if OpenCL enabled, UNSTABLE API
+			KDTREE_DYNAMIC, //!< kd-tree with linear heap, supporting addPoints() and removePoints(); owns a growing copy of the cloud, to whose columns the returned indices refer; removed points keep their column until an internal rebuild
+			KDTREE_FOREST, //!< forest of kd-trees over spatial shards of the cloud, built in parallel; good for NUMA machines and very large clouds
 			SEARCH_TYPE_COUNT //!< number of search types
 		};
 		
@@ -288,7 +340,52 @@ namespace Nabo
 		enum SearchOptionFlags
 		{
 			ALLOW_SELF_MATCH = 1, //!< allows the return of the same point as the query, if this point is in the data cloud; forbidden by default
-			SORT_RESULTS = 2 //!< sort points by distances, when k > 1; do not sort by default
+			SORT_RESULTS = 2, //!< sort points by distances, when k > 1; do not sort by default
+			REORDER_QUERIES = 4 //!< process query columns in a spatially coherent order instead of the caller's order, improving cache locality on large batches; results are still returned in the caller's order
+		};
+		
+		//! statistics of the search for one query point, collected when the search was created with TOUCH_STATISTICS
+		struct QueryStatistics
+		{
+			unsigned long nodesVisited; //!< number of tree nodes visited
+			unsigned long bucketsScanned; //!< number of leaf buckets scanned
+			unsigned long pointsTouched; //!< number of points whose distance was considered
+			unsigned long heapReplacements; //!< number of times a candidate entered the result set
+			double seconds; //!< wall-clock time spent answering this query, in seconds
+			//! constructor, initialises all counters to zero
+			QueryStatistics(): nodesVisited(0), bucketsScanned(0), pointsTouched(0), heapReplacements(0), seconds(0) {}
+		};
+		
+		//! Get the per-query statistics of the last matrix knn() call, aligned with the query columns
+		/*!	Only filled by KDTREE_ searches created with TOUCH_STATISTICS; empty otherwise.
+		 *	\return per-query statistics of the last batch */
+		const std::vector<QueryStatistics>& getQueryStatistics() const { return queryStatistics; }
+		
+		//! Reusable per-thread scratch for single-point queries, created by createSearchContext()
+		/*!	A context must not be used by several threads at once. */
+		struct SearchContext
+		{
+			//! virtual destructor, releases the scratch
+			virtual ~SearchContext() {}
+		};
+		
+		//! Receiver of streamed batch results, see the sink version of knn()
+		/*!	Implement this interface to have results delivered query by query, instead of
+		 *	through caller-allocated k x cols result matrices. */
+		struct ResultSink
+		{
+			//! virtual destructor
+			virtual ~ResultSink() {}
+			//! receive the results of one query
+			/*!	Called once per query as it completes, possibly out of query order and, for searches
+			 *	answering batches in parallel, concurrently from several threads (never for the same
+			 *	query); implementations must therefore be thread-safe across queries. The arrays are
+			 *	only valid during the call.
+			 *	\param queryIndex column of the query in the query matrix
+			 *	\param k number of entries in indices and dists2
+			 *	\param indices indices of the nearest neighbours found; if less than k points were found, the empty entries are 0
+			 *	\param dists2 squared distances to the neighbours, aligned with indices; empty entries are infinity */
+			virtual void onQueryDone(const Index queryIndex, const Index k, const Index* indices, const T* dists2) = 0;
 		};
 		
 		//! Find the k nearest neighbours of query
@@ -304,6 +401,18 @@ namespace Nabo
 		 */
 		unsigned long knn(const Vector& query, IndexVector& indices, Vector& dists2, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
 		
+		//! Create a reusable search context for single-point knn() queries
+		/*!	\param k number of nearest neighbours the context will be used with
+		 *	\return a new context; the caller must delete it after use */
+		virtual SearchContext* createSearchContext(const Index k) const;
+		
+		//! Find the k nearest neighbours of query, reusing the scratch owned by context
+		/*!	Unlike the other single-point version of knn(), the steady-state query path performs no dynamic allocation, which matters when issuing very large numbers of single-point queries.
+		 *	The context must have been created by createSearchContext() of this object, with the same k.
+		 *	The other parameters are those of the single-point version of knn().
+		 *	\return if creationOptionFlags contains TOUCH_STATISTICS, return the number of point touched, otherwise return 0 */
+		virtual unsigned long knn(SearchContext& context, const Vector& query, IndexVector& indices, Vector& dists2, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		
 		//! Find the k nearest neighbours for each point of query
 		/*!	If the search finds less than k points, the empty entries in dists2 will be filled with infinity and the indices with 0.
 		 *	\param query query points
@@ -330,6 +439,149 @@ namespace Nabo
 		 */
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0) const = 0;
 		
+		//! Find the k nearest neighbours for each point of query, warm-started with per-query radius hints
+		/*!	Unlike the maxRadii overload, the hints do not restrict the results: each search is first
+		 *	pruned with its hint, and the few queries whose k neighbours do not all lie within the hint
+		 *	are searched again without it. With hints derived from temporally coherent data, such as the
+		 *	neighbour distances of the previous frame of a tracking loop, most searches thus run at
+		 *	near-verification cost while the results stay identical to a plain knn() call.
+		 *	\param query query points
+		 *	\param indices indices of nearest neighbours, must be of size k x query.cols()
+		 *	\param dists2 squared distances to nearest neighbours, must be of size k x query.cols()
+		 *	\param warmRadii vector of initial search radii, one per query; a hint of infinity disables warm starting for that query
+		 *	\param k number of nearest neighbour requested
+		 *	\param epsilon maximal ratio of error for approximate search, 0 for exact search; has no effect if the number of neighbour found is smaller than the number requested
+		 *	\param optionFlags search options, a bitwise OR of elements of SearchOptionFlags
+		 *	\param maxRadius maximum radius in which to search, can be used to prune search, is not affected by epsilon
+		 *	\return if creationOptionFlags contains TOUCH_STATISTICS, return the number of point touched, otherwise return 0
+		 */
+		unsigned long knnWarmStart(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& warmRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		
+		//! Find the k nearest neighbours for each point of query, warm-started from the results of a previous call
+		/*!	Derives the radius hint of each query from its previous squared neighbour distances: the
+		 *	k-th previous distance plus twice motionBound, as a query point and its neighbours that each
+		 *	moved at most motionBound cannot have drifted further apart. Queries whose previous search
+		 *	found less than k neighbours are not warm-started.
+		 *	\param query query points
+		 *	\param indices indices of nearest neighbours, must be of size k x query.cols()
+		 *	\param dists2 squared distances to nearest neighbours, must be of size k x query.cols()
+		 *	\param priorDists2 squared distances returned by the previous call, must be of size k x query.cols()
+		 *	\param motionBound maximum distance any point may have moved since the previous call
+		 *	\param k number of nearest neighbour requested
+		 *	\param epsilon maximal ratio of error for approximate search, 0 for exact search; has no effect if the number of neighbour found is smaller than the number requested
+		 *	\param optionFlags search options, a bitwise OR of elements of SearchOptionFlags
+		 *	\param maxRadius maximum radius in which to search, can be used to prune search, is not affected by epsilon
+		 *	\return if creationOptionFlags contains TOUCH_STATISTICS, return the number of point touched, otherwise return 0
+		 */
+		unsigned long knnWarmStartFromPrior(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Matrix& priorDists2, const T motionBound, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		
+		//! Find the k nearest neighbours for each point of query, streaming the results into sink
+		/*!	No result matrices are allocated: each query's neighbours are handed to the sink as the
+		 *	query completes, so results go straight into user data structures. The KDTREE_ searches
+		 *	stream from their query loop directly; other search types fall back to answering the batch
+		 *	in bounded blocks, keeping memory use independent of the query count.
+		 *	\param query query points
+		 *	\param sink receiver of the per-query results, see ResultSink
+		 *	\param k number of nearest neighbour requested
+		 *	\param epsilon maximal ratio of error for approximate search, 0 for exact search; has no effect if the number of neighbour found is smaller than the number requested
+		 *	\param optionFlags search options, a bitwise OR of elements of SearchOptionFlags
+		 *	\param maxRadius maximum radius in which to search, can be used to prune search, is not affected by epsilon
+		 *	\return if creationOptionFlags contains TOUCH_STATISTICS, return the number of point touched, otherwise return 0
+		 */
+		virtual unsigned long knn(const Matrix& query, ResultSink& sink, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		
+		//! Find the largest epsilon whose recall on a sample of queries stays at or above targetRecall
+		/*!	Runs an exact reference pass over sampleQueries, then binary-searches epsilon, measuring for
+		 *	each candidate the fraction of returned neighbours that are as close as the exact k-th one.
+		 *	Since the cost of a query decreases monotonically with epsilon, the returned value captures
+		 *	the full approximate-search speedup the recall target allows; pass it to subsequent knn()
+		 *	calls. Meaningful for the approximate KDTREE_ searches; searches that ignore epsilon report
+		 *	full recall everywhere and yield maxEpsilon.
+		 *	\param sampleQueries sample of query points, representative of the production queries
+		 *	\param k number of nearest neighbours that will be requested in production
+		 *	\param targetRecall smallest acceptable fraction of exact neighbours returned, in (0, 1]
+		 *	\param optionFlags search options that will be used in production, a bitwise OR of elements of SearchOptionFlags
+		 *	\param maxEpsilon largest epsilon considered
+		 *	\return the largest epsilon in [0, maxEpsilon] whose measured recall is at least targetRecall
+		 */
+		T calibrateEpsilon(const Matrix& sampleQueries, const Index k = 1, const T targetRecall = T(0.95), const unsigned optionFlags = 0, const T maxEpsilon = T(10)) const;
+		
+		//! Find the k nearest neighbours of every point of the cloud within the cloud itself
+		/*!	Equivalent to a knn() batch with the cloud as its own query matrix, but the KDTREE_ searches
+		 *	process the points bucket by bucket: the distances within a bucket give each point a radius
+		 *	bound that its k nearest neighbours cannot exceed, which prunes the descent from the root,
+		 *	and consecutive queries of a bucket traverse the same tree regions. Self matches are excluded
+		 *	unless optionFlags contains ALLOW_SELF_MATCH.
+		 *	\param indices indices of nearest neighbours, must be of size k x the number of cloud points
+		 *	\param dists2 squared distances to nearest neighbours, must be of size k x the number of cloud points
+		 *	\param k number of nearest neighbour requested
+		 *	\param epsilon maximal ratio of error for approximate search, 0 for exact search; has no effect if the number of neighbour found is smaller than the number requested
+		 *	\param optionFlags search options, a bitwise OR of elements of SearchOptionFlags
+		 *	\param maxRadius maximum radius in which to search, can be used to prune search, is not affected by epsilon
+		 *	\return if creationOptionFlags contains TOUCH_STATISTICS, return the number of point touched, otherwise return 0
+		 */
+		virtual unsigned long selfKnn(IndexMatrix& indices, Matrix& dists2, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		
+		//! Start knn() on a background thread, so that the caller can overlap query batches with other work
+		/*!	The query, indices, and dists2 matrices must stay alive and untouched until AsyncQuery::wait() has returned.
+		 *	The parameters are those of the matrix version of knn().
+		 *	\return a handle on the running query; the caller must delete it after use */
+		AsyncQuery* knnAsync(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+
+		//! Find all points within radius of query
+		/*!	Unlike knn() with maxRadius, no number of neighbours has to be guessed and no per-neighbour heap is maintained;
+		 *	the given vectors are cleared and grown as needed, so they can be reused across queries to avoid allocations.
+		 *	\param query query point
+		 *	\param radius radius in which to search
+		 *	\param indices indices of the points found within radius
+		 *	\param dists2 squared distances to the points found, aligned with indices
+		 *	\param optionFlags search options, a bitwise OR of elements of SearchOptionFlags
+		 *	\return number of points found
+		 */
+		virtual unsigned long radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags = 0) const;
+
+		//! Add points to the data-point cloud, only supported by dynamic search types such as KDTREE_DYNAMIC
+		/*!	Added points are searched through a side buffer until enough of them have accumulated to amortize a rebuild of the main tree.
+		 *	\param newPoints points to add, one per column; must have at least the dimensionality of the cloud */
+		virtual void addPoints(const Matrix& newPoints);
+
+		//! Remove points from the data-point cloud, only supported by dynamic search types such as KDTREE_DYNAMIC
+		/*!	Removed points are masked out of query results until enough of them have accumulated to amortize a rebuild of the main tree.
+		 *	Beware that a rebuild compacts the cloud, so indices of points beyond removed ones change.
+		 *	\param indices indices of the points to remove */
+		virtual void removePoints(const IndexVector& indices);
+
+		//! Return the indices of the cloud points in tree-leaf order, only supported by the static KDTREE_ search types
+		/*!	Points of the same leaf bucket are consecutive, following the depth-first order of the tree, so
+		 *	spatially close points end up close in the returned order. Rewriting an out-of-core cloud file in
+		 *	this order and rebuilding over it makes every leaf visit touch one contiguous run of the file,
+		 *	see \ref OutOfCore.
+		 *	\return for each position of the order, the index of the cloud point it holds */
+		virtual IndexVector getLeafOrder() const;
+		
+		//! Rebuild the search structure over the current content of the cloud
+		/*!	The search structure references the cloud passed at creation; to index a new scan,
+		 *	overwrite that matrix with the new points (the number of points may change, the number of
+		 *	rows may not) and call rebuild(). The KDTREE_ searches reuse the storage of their nodes and
+		 *	buckets and of the build scratch, so that rebuilding is allocation-free once these have
+		 *	reached their steady-state capacity, and the object itself persists so that holders of the
+		 *	pointer need not be notified. Results of queries running concurrently with rebuild() are
+		 *	undefined. */
+		virtual void rebuild();
+
+		//! Save the search structure to a file, which load() can read back without a rebuild
+		/*!	The file only holds the search structure, not the data-point cloud; the same cloud must be passed to load().
+		 *	The format is binary and in host byte order, it is thus not portable across architectures.
+		 *	\param fileName name of the file to write */
+		virtual void save(const std::string& fileName) const;
+
+		//! Load a search structure previously written by save(), avoiding a full rebuild
+		/*!	\param cloud data-point cloud in which to search, must hold the same points as when save() was called
+		 *	\param fileName name of the file to read
+		 *	\param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
+		 *	\return an object on which to run nearest neighbour queries */
+		static NearestNeighbourSearch* load(const CloudType& cloud, const std::string& fileName, const unsigned creationOptionFlags = 0);
+
 		//! Create a nearest-neighbour search
 		/*!	\param cloud data-point cloud in which to search
 		 *	\param dim number of dimensions to consider, must be lower or equal to cloud.rows()
@@ -337,7 +589,7 @@ namespace Nabo
 		 *	\param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
 		 *	\param additionalParameters additional parameters, currently only useful for KDTREE_
 		 *	\return an object on which to run nearest neighbour queries */
-		static NearestNeighbourSearch* create(const Matrix& cloud, const Index dim = std::numeric_limits<Index>::max(), const SearchType preferedType = KDTREE_LINEAR_HEAP, const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
+		static NearestNeighbourSearch* create(const CloudType& cloud, const Index dim = std::numeric_limits<Index>::max(), const SearchType preferedType = KDTREE_LINEAR_HEAP, const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
 		
 		//! Create a nearest-neighbour search, using brute-force search, useful for comparison only
 		/*!	This is an helper function, you can also use create() with BRUTE_FORCE as preferedType
@@ -345,7 +597,7 @@ namespace Nabo
 		 *	\param dim number of dimensions to consider, must be lower or equal to cloud.rows()
 		 *	\param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
 		 *	\return an object on which to run nearest neighbour queries */
-		static NearestNeighbourSearch* createBruteForce(const Matrix& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0);
+		static NearestNeighbourSearch* createBruteForce(const CloudType& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0);
 		
 		//! Create a nearest-neighbour search, using a kd-tree with linear heap, good for small k (~up to 30)
 		/*!	This is an helper function, you can also use create() with KDTREE_LINEAR_HEAP as preferedType
@@ -354,7 +606,7 @@ namespace Nabo
 		 *	\param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
 		 *	\param additionalParameters additional parameters
 		 * 	\return an object on which to run nearest neighbour queries */
-		static NearestNeighbourSearch* createKDTreeLinearHeap(const Matrix& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
+		static NearestNeighbourSearch* createKDTreeLinearHeap(const CloudType& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
 		
 		//! Create a nearest-neighbour search, using a kd-tree with tree heap, good for large k (~from 30)
 		/*!	This is an helper function, you can also use create() with KDTREE_TREE_HEAP as preferedType
@@ -363,14 +615,14 @@ namespace Nabo
 		 *	\param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
 		 *	\param additionalParameters additional parameters
 		 * 	\return an object on which to run nearest neighbour queries */
-		static NearestNeighbourSearch* createKDTreeTreeHeap(const Matrix& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
+		static NearestNeighbourSearch* createKDTreeTreeHeap(const CloudType& cloud, const Index dim = std::numeric_limits<Index>::max(), const unsigned creationOptionFlags = 0, const Parameters& additionalParameters = Parameters());
 		
 		//! virtual destructor
 		virtual ~NearestNeighbourSearch() {}
 		
 	protected:
 		//! constructor
-		NearestNeighbourSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags);
+		NearestNeighbourSearch(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags);
 		
 		//! Make sure that the output matrices have the right sizes. Throw an exception otherwise.
 		/*!	\param query query points
@@ -380,6 +632,9 @@ namespace Nabo
 		 *	\param optionFlags the options passed to knn()
 			\param maxRadii if non 0, maximum radii, must be of size k */
 		void checkSizesKnn(const Matrix& query, const IndexMatrix& indices, const Matrix& dists2, const Index k, const unsigned optionFlags, const Vector* maxRadii = 0) const;
+
+		//! per-query statistics of the last matrix knn() call, filled when created with TOUCH_STATISTICS
+		mutable std::vector<QueryStatistics> queryStatistics;
 	};
 	
 	// Convenience typedefs
@@ -388,6 +643,65 @@ namespace Nabo
 	typedef NearestNeighbourSearch<float> NNSearchF;
 	//! nearest neighbour search with scalars of type double
 	typedef NearestNeighbourSearch<double> NNSearchD;
+	//! Save a data-point cloud to a binary cloud file, which loadCloudFile() and MappedCloudFile can read back
+	/*!	The format is a small header (magic, scalar size, dimension, point count) followed by the raw
+	 *	scalars of the points in point-major order. It is written in host byte order and is thus not
+	 *	portable across architectures, but loads orders of magnitude faster than parsing text.
+	 *	\param fileName name of the file to write
+	 *	\param cloud data-point cloud to write, one point per column */
+	template<typename T>
+	void saveCloudFile(const std::string& fileName, const typename NearestNeighbourSearch<T>::Matrix& cloud);
+
+	//! Load a data-point cloud written by saveCloudFile()
+	/*!	The scalar type must match the one the file was saved with, no conversion is performed.
+	 *	\param fileName name of the file to read
+	 *	\return the cloud, one point per column */
+	template<typename T>
+	typename NearestNeighbourSearch<T>::Matrix loadCloudFile(const std::string& fileName);
+
+#ifdef EIGEN3_API
+	//! nearest neighbour search indexing a float cloud mapped from external storage in place
+	typedef NearestNeighbourSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> > NNSearchMappedF;
+	//! nearest neighbour search indexing a double cloud mapped from external storage in place
+	typedef NearestNeighbourSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> > NNSearchMappedD;
+	//! nearest neighbour search indexing a float cloud mapped from external storage with padded points in place; construct the map from a raw pointer, the dimensions, and an Eigen::OuterStride giving the scalar count from one point to the next
+	typedef NearestNeighbourSearch<float, Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > > NNSearchStridedF;
+	//! nearest neighbour search indexing a double cloud mapped from external storage with padded points in place, see NNSearchStridedF
+	typedef NearestNeighbourSearch<double, Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::OuterStride<> > > NNSearchStridedD;
+	
+	//! A data-point cloud memory-mapped read-only from a raw binary file, for searching clouds larger than RAM
+	/*!	The file must hold the scalars of the points contiguously in point-major order (all the coordinates
+	 *	of a point, then the next point), without any header. The mapping is backed by the operating-system
+	 *	page cache, so only the pages that queries touch are read from disk and the resident set adapts to
+	 *	the available memory; see \ref OutOfCore for how to lay out the file for the best page locality.
+	 *	The \c cloud member stays valid as long as this object lives. Only available on POSIX platforms.
+	 */
+	template<typename T>
+	struct MappedCloudFile
+	{
+		//! matrix type of the mapped cloud, one point per column
+		typedef Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Aligned> CloudType;
+		
+		//! map fileName, whose size must be a non-zero multiple of the size of a dim-dimensional point
+		MappedCloudFile(const std::string& fileName, const int dim);
+		//! map a cloud file written by saveCloudFile(), reading the dimensions from its header; this is the zero-copy load path for such files
+		explicit MappedCloudFile(const std::string& fileName);
+		//! unmap the file, invalidating cloud
+		~MappedCloudFile();
+		
+	protected:
+		//! number of bytes mapped
+		const size_t byteCount;
+		//! file descriptor of the mapped file
+		const int fd;
+		//! start of the mapping
+		const void* const data;
+		
+	public:
+		//! the mapped cloud, to be passed to NearestNeighbourSearch<T, MappedCloudFile<T>::CloudType>::create()
+		const CloudType cloud;
+	};
+#endif // EIGEN3_API
 	
 	//@}
 }
@@ -33,6 +33,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __NABO_PRIVATE_H
 
 #include "nabo.h"
+#include <iosfwd>
+#include <algorithm>
 
 #ifdef BOOST_STDINT
 	#include <boost/cstdint.hpp>
@@ -71,44 +73,114 @@ namespace Nabo
 		return (v0 - v1).squaredNorm();
 	}
 
+	//! Sort radius-search results in place, from the smallest to the largest distance
+	/** \param indices indices of the points found
+	 * \param dists2 squared distances to the points found, aligned with indices
+	 */
+	template<typename T, typename Index>
+	void sortRadiusResults(std::vector<Index>& indices, std::vector<T>& dists2)
+	{
+		typedef std::pair<T, Index> Entry;
+		std::vector<Entry> entries;
+		entries.reserve(indices.size());
+		for (size_t i = 0; i < indices.size(); ++i)
+			entries.push_back(Entry(dists2[i], indices[i]));
+		std::sort(entries.begin(), entries.end());
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			dists2[i] = entries[i].first;
+			indices[i] = entries[i].second;
+		}
+	}
+
+	//! header of the binary file format written by save(), followed by the bounds, the nodes, and the bucket-entry point indices
+	struct KDTreeFileHeader
+	{
+		char magic[8]; //!< file type identification, must be "NABOTREE"
+		uint32_t version; //!< version of the file format, 1 for 32-bit packed node indices, 2 for 64-bit ones
+		uint32_t scalarSize; //!< size of the scalar type in bytes
+		uint32_t searchType; //!< type of search the tree was built for, one of SearchType
+		uint32_t dim; //!< the dimensionality of the data-point cloud
+		uint32_t bucketSize; //!< size of bucket
+		uint32_t dimBitCount; //!< number of bits required to store dimension index + number of dimensions
+		uint64_t pointCount; //!< number of points in the data-point cloud
+		uint64_t nodeCount; //!< number of search nodes
+		uint64_t bucketCount; //!< number of bucket entries
+	};
+
+	//! return whether the node-count estimate of a kd-tree over pointCount points of dimension dim overflows the default 32-bit packed node indices
+	bool kdTreeNeedsLargeNodeIndices(const size_t pointCount, const unsigned dim, const unsigned bucketSize);
+
+	//! header of the binary cloud file format written by saveCloudFile(), followed by the point scalars in point-major order
+	/** The header is 32 bytes so that the payload of a memory-mapped file stays 16-byte aligned. */
+	struct CloudFileHeader
+	{
+		char magic[8]; //!< file type identification, must be "NABOCLD1"
+		uint32_t scalarSize; //!< size of the scalar type in bytes
+		uint32_t dim; //!< dimensionality of the points
+		uint64_t pointCount; //!< number of points
+		uint64_t reserved; //!< padding, must be 0
+	};
+
+	//! read and validate the header of a cloud file, checking the magic, the scalar size, and that the file holds exactly the announced payload
+	CloudFileHeader readCloudFileHeader(const std::string& fileName, const size_t scalarSize);
+
 	//! Brute-force nearest neighbour
-	template<typename T>
-	struct BruteForceSearch: public NearestNeighbourSearch<T>
+	template<typename T, typename Cloud_T = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >
+	struct BruteForceSearch: public NearestNeighbourSearch<T, Cloud_T>
 	{
-		typedef typename NearestNeighbourSearch<T>::Vector Vector;
-		typedef typename NearestNeighbourSearch<T>::Matrix Matrix;
-		typedef typename NearestNeighbourSearch<T>::Index Index;
-		typedef typename NearestNeighbourSearch<T>::IndexVector IndexVector;
-		typedef typename NearestNeighbourSearch<T>::IndexMatrix IndexMatrix;
-		
-		using NearestNeighbourSearch<T>::dim;
-		using NearestNeighbourSearch<T>::creationOptionFlags;
-		using NearestNeighbourSearch<T>::checkSizesKnn;
-		using NearestNeighbourSearch<T>::minBound;
-		using NearestNeighbourSearch<T>::maxBound;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Vector Vector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::CloudType CloudType;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Index Index;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexVector IndexVector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		
+		using NearestNeighbourSearch<T, Cloud_T>::dim;
+		using NearestNeighbourSearch<T, Cloud_T>::creationOptionFlags;
+		using NearestNeighbourSearch<T, Cloud_T>::checkSizesKnn;
+		using NearestNeighbourSearch<T, Cloud_T>::minBound;
+		using NearestNeighbourSearch<T, Cloud_T>::maxBound;
 
-		//! constructor, calls NearestNeighbourSearch<T>(cloud)
-		BruteForceSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags);
+	protected:
+		//! number of queries and cloud points per tile of the matrix-product batch path, 0 to scan pairs one at a time
+		const unsigned gemmBlockSize;
+		//! squared norm of every cloud point, only filled if gemmBlockSize is non-zero
+		Vector cloudNorms2;
+
+		//! batch search expanding ||q-p||^2 with the norm trick, computing cross-terms tile by tile with matrix products
+		unsigned long knnBlocked(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k, const unsigned optionFlags) const;
+
+	public:
+		//! constructor, calls NearestNeighbourSearch<T, Cloud_T>(cloud)
+		BruteForceSearch(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters = Parameters());
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0) const;
 	};
 	
 	//! KDTree, unbalanced, points in leaves, stack, implicit bounds, ANN_KD_SL_MIDPT, optimised implementation
-	template<typename T, typename Heap>
-	struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt: public NearestNeighbourSearch<T>
+	/** PackedIndexT is the unsigned integer in which a node packs its cut dimension together with
+	 * its right-child index or bucket size; the default 32 bits cap the addressable node count,
+	 * uint64_t lifts the cap for billion-point clouds at the price of larger nodes. */
+	template<typename T, typename Heap, typename Cloud_T = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, typename PackedIndexT = uint32_t>
+	struct KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt: public NearestNeighbourSearch<T, Cloud_T>
 	{
-		typedef typename NearestNeighbourSearch<T>::Vector Vector;
-		typedef typename NearestNeighbourSearch<T>::Matrix Matrix;
-		typedef typename NearestNeighbourSearch<T>::Index Index;
-		typedef typename NearestNeighbourSearch<T>::IndexVector IndexVector;
-		typedef typename NearestNeighbourSearch<T>::IndexMatrix IndexMatrix;
-		
-		using NearestNeighbourSearch<T>::dim;
-		using NearestNeighbourSearch<T>::cloud;
-		using NearestNeighbourSearch<T>::creationOptionFlags;
-		using NearestNeighbourSearch<T>::minBound;
-		using NearestNeighbourSearch<T>::maxBound;
-		using NearestNeighbourSearch<T>::checkSizesKnn;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Vector Vector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::CloudType CloudType;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Index Index;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexVector IndexVector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::QueryStatistics QueryStatistics;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::SearchContext SearchContext;
+		
+		using NearestNeighbourSearch<T, Cloud_T>::dim;
+		using NearestNeighbourSearch<T, Cloud_T>::cloud;
+		using NearestNeighbourSearch<T, Cloud_T>::creationOptionFlags;
+		using NearestNeighbourSearch<T, Cloud_T>::minBound;
+		using NearestNeighbourSearch<T, Cloud_T>::maxBound;
+		using NearestNeighbourSearch<T, Cloud_T>::checkSizesKnn;
+		using NearestNeighbourSearch<T, Cloud_T>::queryStatistics;
 		
 	protected:
 		//! indices of points during kd-tree construction
@@ -120,40 +192,63 @@ namespace Nabo
 		
 		//! size of bucket
 		const unsigned bucketSize;
-		
+
+		//! number of threads used to build the tree, 0 for one per core, 1 for serial build
+		const unsigned buildParallelism;
+
+		//! maximum number of threads used to answer a query batch, 0 for the OpenMP default
+		const unsigned maxThreads;
+
+		//! if non-zero, answer queries with a best-bin-first traversal that stops after visiting this many buckets
+		const unsigned maxLeafVisited;
+
+		//! whether bucket coordinates are copied into a contiguous structure-of-arrays block to speed up leaf scans
+		const bool soaBuckets;
+
+		//! whether bucket coordinates are stored quantized to 16 bits relative to the cloud bounds, shrinking the bytes touched per query
+		const bool quantizedBuckets;
+
+		//! node layout applied after construction, 1 for the cache-packed breadth order of relayoutNodes()
+		const unsigned nodeLayout;
+
+		//! maximum bucket size allowed when soaBuckets is set, as the leaf scan uses stack scratch of this size
+		enum { maxSoABucketSize = 256 };
+
 		//! number of bits required to store dimension index + number of dimensions
 		const uint32_t dimBitCount;
 		//! mask to access dim
-		const uint32_t dimMask;
+		const PackedIndexT dimMask;
 		
 		//! create the compound index containing the dimension and the index of the child or the bucket size
-		inline uint32_t createDimChildBucketSize(const uint32_t dim, const uint32_t childIndex) const
-		{ return dim | (childIndex << dimBitCount); }
+		inline PackedIndexT createDimChildBucketSize(const uint32_t dim, const size_t childIndex) const
+		{ return PackedIndexT(dim) | (PackedIndexT(childIndex) << dimBitCount); }
 		//! get the dimension out of the compound index
-		inline uint32_t getDim(const uint32_t dimChildBucketSize) const
-		{ return dimChildBucketSize & dimMask; }
+		inline uint32_t getDim(const PackedIndexT dimChildBucketSize) const
+		{ return uint32_t(dimChildBucketSize & dimMask); }
 		//! get the child index or the bucket size out of the coumpount index
-		inline uint32_t getChildBucketSize(const uint32_t dimChildBucketSize) const
-		{ return dimChildBucketSize >> dimBitCount; }
+		inline size_t getChildBucketSize(const PackedIndexT dimChildBucketSize) const
+		{ return size_t(dimChildBucketSize >> dimBitCount); }
 		
 		struct BucketEntry;
 		
 		//! search node
 		struct Node
 		{
-			uint32_t dimChildBucketSize; //!< cut dimension for split nodes (dimBitCount lsb), index of right node or number of bucket(rest). Note that left index is current+1
+			PackedIndexT dimChildBucketSize; //!< cut dimension for split nodes (dimBitCount lsb), index of right node or number of bucket(rest). Note that left index is current+1
 			union
 			{
 				T cutVal; //!< for split node, split value
-				uint32_t bucketIndex; //!< for leaf node, pointer to bucket
+				PackedIndexT bucketIndex; //!< for leaf node, pointer to bucket
 			};
 			
+			//! construct an uninitialised node, whose content is overwritten when loading a tree dump
+			Node() {}
 			//! construct a split node
-			Node(const uint32_t dimChild, const T cutVal):
+			Node(const PackedIndexT dimChild, const T cutVal):
 				dimChildBucketSize(dimChild), cutVal(cutVal) {}
 			//! construct a leaf node
-			Node(const uint32_t bucketSize, const uint32_t bucketIndex):
-				dimChildBucketSize(bucketSize), bucketIndex(bucketIndex) {}
+			Node(const PackedIndexT bucketSize, const size_t bucketIndex):
+				dimChildBucketSize(bucketSize), bucketIndex(PackedIndexT(bucketIndex)) {}
 		};
 		//! dense vector of search nodes, provides better memory performances than many small objects
 		typedef std::vector<Node> Nodes;
@@ -176,30 +271,108 @@ namespace Nabo
 		
 		//! search nodes
 		Nodes nodes;
-		
+
 		//! buckets
 		Buckets buckets;
-		
+
+		//! scratch list of point indices used while building, kept allocated so that rebuild() reuses its storage
+		BuildPoints buildPoints;
+
+		//! structure-of-arrays copy of the bucket coordinates, only filled if soaBuckets is set
+		/** The block of the bucket starting at bucket index \c bi holds, for each dimension in turn,
+		 * the coordinates of all its points contiguously, starting at element bi * dim. */
+		std::vector<T> bucketCoords;
+
+		//! fill bucketCoords from the buckets, no-op unless soaBuckets is set
+		void buildSoABuckets();
+
+		//! 16-bit quantized copy of the bucket coordinates, same layout as bucketCoords, only filled if quantizedBuckets is set
+		std::vector<uint16_t> quantizedCoords;
+		//! size of one quantization step on each dimension, in cloud units
+		std::vector<T> quantStep;
+		//! upper bound on the distance between a point and its quantized position
+		T quantHalfDiagonal;
+
+		//! fill quantizedCoords and the quantization constants from the buckets and bounds, no-op unless quantizedBuckets is set
+		void buildQuantizedBuckets();
+
 		//! return the bounds of points from [first..last[ on dimension dim
 		std::pair<T,T> getBounds(const BuildPointsIt first, const BuildPointsIt last, const unsigned dim);
-		//! construct nodes for points [first..last[ inside the hyperrectangle [minValues..maxValues]
-		unsigned buildNodes(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues);
-		
-		//! search one point, call recurseKnn with the correct template parameters
-		/** \param query pointer to query coordinates 
+		//! select the cut dimension and value for points [first..last[, and partition the points around the cut
+		/** \param first iterator to first point
+		 * \param last iterator past the last point
+		 * \param minValues low bound of the hyperrectangle containing the points
+		 * \param maxValues high bound of the hyperrectangle containing the points
+		 * \param cutDim return value, dimension of the cut
+		 * \param cutVal return value, value of the cut
+		 * \return number of points on the left of the cut, in [1..count-1]
+		 */
+		int splitPoints(const BuildPointsIt first, const BuildPointsIt last, const Vector& minValues, const Vector& maxValues, unsigned& cutDim, T& cutVal);
+		//! construct nodes for points [first..last[ inside the hyperrectangle [minValues..maxValues], into the given node and bucket vectors
+		size_t buildNodes(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues, Nodes& intoNodes, Buckets& intoBuckets);
+		//! construct nodes as buildNodes(), spawning tasks for subtrees down to parallelDepth, each filling its own node and bucket vectors that are stitched back together
+		size_t buildNodesParallel(const BuildPointsIt first, const BuildPointsIt last, const Vector minValues, const Vector maxValues, Nodes& intoNodes, Buckets& intoBuckets, const int parallelDepth);
+		//! reorder nodes into a breadth-blocked layout that keeps the upper levels of the tree contiguous, rewriting child indices
+		void relayoutNodes();
+		//! build the tree over the current content of the cloud, reusing the storage of nodes, buckets and buildPoints
+		void buildTree();
+		
+		//! search one point, dispatch to the version of onePointKnn specialised for the dimension of the cloud
+		/** \param query pointer to query coordinates
 		 *	\param indices indices of nearest neighbours, must be of size k x query.cols()
-		 *	\param dists2 squared distances to nearest neighbours, must be of size k x query.cols() 
+		 *	\param dists2 squared distances to nearest neighbours, must be of size k x query.cols()
 		 *	\param i index of point to search
 		 * 	\param heap reference to heap
 		 * 	\param off reference to array of offsets
-		 *	\param maxError error factor (1 + epsilon) 
+		 *	\param maxError error factor (1 + epsilon)
 		 *	\param maxRadius2 square of maximum radius
 		 *	\param allowSelfMatch whether to allow self match
 		 *	\param collectStatistics whether to collect statistics
 		 *	\param sortResults wether to sort results
 		 */
 		unsigned long onePointKnn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, int i, Heap& heap, std::vector<T>& off, const T maxError, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults) const;
-		
+
+		//! search one point given by a pointer to its coordinates, dispatch to the version specialised for the dimension of the cloud
+		/** The k-best points are left in heap, from which the caller reads them back;
+		 *	the other parameters are those of the matrix overload.
+		 *	\param stats statistics of this query, only filled when collectStatistics is true */
+		unsigned long onePointKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults, QueryStatistics& stats) const;
+
+		//! search one point, call recurseKnn with the correct template parameters
+		/** The parameters are those of the pointer-based dispatching overload; staticDim is the compile-time
+		 *	dimension of the cloud (allowing the distance loops to be unrolled), or -1 if only known at run time. */
+		template<int staticDim>
+		unsigned long onePointKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError, const T maxRadius2, const bool allowSelfMatch, const bool collectStatistics, const bool sortResults, QueryStatistics& stats) const;
+
+		//! Scratch of the allocation-free single-point query path, see createSearchContext()
+		struct KnnSearchContext: public SearchContext
+		{
+			const Index k; //!< number of neighbours the scratch was sized for
+			Heap heap; //!< k-best list
+			std::vector<T> off; //!< array of offsets
+			//! constructor, allocates the scratch for k neighbours in a dim-dimensional cloud
+			KnnSearchContext(const Index k, const Index dim): k(k), heap(k), off(dim, 0) {}
+		};
+
+		//! entry of the best-bin-first traversal queue: a pending subtree and the distance to its hyperrectangle
+		struct BBFEntry
+		{
+			T rd; //!< squared distance from the query to the subtree's hyperrectangle
+			size_t n; //!< index of the subtree's root node
+			uint32_t offIndex; //!< start of the subtree's offset vector in the offsets arena
+			//! constructor
+			BBFEntry(const T rd, const size_t n, const uint32_t offIndex): rd(rd), n(n), offIndex(offIndex) {}
+			//! order entries so that the closest subtree comes on top of the priority queue
+			bool operator<(const BBFEntry& that) const { return rd > that.rd; }
+		};
+
+		//! best-bin-first search bounded by maxLeafVisited buckets, see [Beis & Lowe, Shape indexing using approximate nearest-neighbour search, 1997]
+		/**	Subtrees are visited in order of the distance from the query to their hyperrectangles, so when the
+		 *	budget runs out the buckets most likely to hold the true neighbours have been scanned already.
+		 *	The parameters are those of recurseKnn(), without the traversal state held on the queue. */
+		template<bool allowSelfMatch>
+		unsigned long bestBinFirstKnn(const T* query, Heap& heap, std::vector<T>& off, const T maxError2, const T maxRadius2, const bool collectStatistics, QueryStatistics& stats) const;
+
 		//! recursive search, strongly inspired by ANN and [Arya & Mount, Algorithms for fast vector quantization, 1993]
 		/**	\param query pointer to query coordinates 
 		 * 	\param n index of node to visit
@@ -208,20 +381,190 @@ namespace Nabo
 		 * 	\param off reference to array of offsets
 		 * 	\param maxError error factor (1 + epsilon) 
 		 *	\param maxRadius2 square of maximum radius
+		 *
+		 *	staticDim is the compile-time dimension of the cloud (allowing the distance loops to be unrolled), or -1 if only known at run time.
+		 */
+		template<bool allowSelfMatch, bool collectStatistics, bool soaScan, bool quantScan, int staticDim>
+		unsigned long recurseKnn(const T* query, const size_t n, T rd, Heap& heap, std::vector<T>& off, const T maxError, const T maxRadius2, QueryStatistics& stats) const;
+
+		//! recursive search specialised for k = 1, keeping the single best candidate in scalars instead of a heap
+		/**	\param bestDist2 squared distance to the best candidate found so far, updated in place
+		 *	\param bestIndex index of the best candidate found so far, updated in place
+		 *
+		 *	The other parameters are those of recurseKnn(). */
+		template<bool allowSelfMatch, bool collectStatistics, int staticDim>
+		unsigned long recurseKnn1(const T* query, const size_t n, T rd, T& bestDist2, Index& bestIndex, std::vector<T>& off, const T maxError2, const T maxRadius2, QueryStatistics& stats) const;
+
+		//! recursive range search, appending all points within maxRadius2 of query to indices and dists2
+		/**	\param query pointer to query coordinates
+		 * 	\param n index of node to visit
+		 * 	\param rd squared dist to this rect
+		 * 	\param off reference to array of offsets
+		 *	\param maxRadius2 square of search radius
+		 *	\param indices indices of the points found so far
+		 *	\param dists2 squared distances to the points found so far, aligned with indices
 		 */
-		template<bool allowSelfMatch, bool collectStatistics>
-		unsigned long recurseKnn(const T* query, const unsigned n, T rd, Heap& heap, std::vector<T>& off, const T maxError, const T maxRadius2) const;
+		template<bool allowSelfMatch>
+		void recurseRange(const T* query, const size_t n, T rd, std::vector<T>& off, const T maxRadius2, std::vector<Index>& indices, std::vector<T>& dists2) const;
 		
 	public:
-		//! constructor, calls NearestNeighbourSearch<T>(cloud)
-		KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters);
+		//! constructor, calls NearestNeighbourSearch<T, Cloud_T>(cloud)
+		KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters);
+		//! constructor from a tree dump previously written by save(), calls NearestNeighbourSearch<T, Cloud_T>(cloud)
+		/** \param cloud data-point cloud in which to search, must hold the same points as when save() was called
+		 * \param creationOptionFlags creation options, a bitwise OR of elements of CreationOptionFlags
+		 * \param fileHeader header of the dump, as read by load()
+		 * \param stream stream positioned just after the header
+		 */
+		KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt(const CloudType& cloud, const unsigned creationOptionFlags, const KDTreeFileHeader& fileHeader, std::istream& stream);
+		virtual void save(const std::string& fileName) const;
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0) const;
+		virtual SearchContext* createSearchContext(const Index k) const;
+		virtual unsigned long knn(SearchContext& context, const Vector& query, IndexVector& indices, Vector& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		virtual unsigned long knn(const Matrix& query, typename NearestNeighbourSearch<T, Cloud_T>::ResultSink& sink, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		virtual unsigned long selfKnn(IndexMatrix& indices, Matrix& dists2, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0, const T maxRadius = std::numeric_limits<T>::infinity()) const;
+		virtual unsigned long radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags = 0) const;
+		virtual IndexVector getLeafOrder() const;
+		virtual void rebuild();
+		//! refresh the per-point pointers cached in the buckets after the cloud storage has been reallocated, e.g. by a resize that kept the indexed columns in place
+		void rebindCloud();
 	};
-	
+
+	//! Storage for a growable copy of the data-point cloud
+	/** Used as first base of KDTreeDynamic so that the matrix is constructed before
+	 * NearestNeighbourSearch, whose cloud reference points at it. */
+	template<typename T>
+	struct DynamicCloudStorage
+	{
+		//! a column-major Eigen matrix in which each column is a point
+		typedef typename Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+
+		//! owned copy of the cloud: the points covered by the main tree first, followed by those added since the last rebuild
+		/** This is what the cloud member of NearestNeighbourSearch references, so the indices
+		 * returned by searches are always valid columns of the public cloud. */
+		Matrix points;
+
+		//! construct the storage from an initial cloud
+		DynamicCloudStorage(const Matrix& cloud): points(cloud) {}
+	};
+
+	//! KDTree supporting incremental point addition and removal, by a side buffer and periodic rebuilds of a static tree
+	template<typename T, typename Heap>
+	struct KDTreeDynamic: protected DynamicCloudStorage<T>, public NearestNeighbourSearch<T>
+	{
+		typedef typename NearestNeighbourSearch<T>::Vector Vector;
+		typedef typename NearestNeighbourSearch<T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T>::Index Index;
+		typedef typename NearestNeighbourSearch<T>::IndexVector IndexVector;
+		typedef typename NearestNeighbourSearch<T>::IndexMatrix IndexMatrix;
+
+		using NearestNeighbourSearch<T>::dim;
+		using NearestNeighbourSearch<T>::creationOptionFlags;
+		using NearestNeighbourSearch<T>::minBound;
+		using NearestNeighbourSearch<T>::maxBound;
+		using NearestNeighbourSearch<T>::checkSizesKnn;
+		using DynamicCloudStorage<T>::points;
+
+	protected:
+		//! type of the main tree
+		typedef KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap> Tree;
+
+		//! construction parameters, kept to pass to the main tree at each rebuild
+		const Parameters additionalParameters;
+
+		//! number of modifications (side-buffer points plus removals) that trigger a rebuild of the main tree, 0 for automatic
+		const unsigned rebuildThreshold;
+
+		//! main tree, over the first treeCols columns of points; 0 if all points have been removed
+		Tree* tree;
+
+		//! number of leading columns of points covered by the main tree; the following columns are searched by brute force
+		Index treeCols;
+
+		//! for each point (tree then side buffer), whether it has been removed
+		std::vector<bool> removed;
+
+		//! number of removed points not yet compacted away
+		Index removedCount;
+
+		//! return the number of modifications that trigger a rebuild
+		unsigned effectiveRebuildThreshold() const;
+
+		//! compact removed points, merge the side buffer into points, and rebuild the main tree
+		void rebuild();
+
+	public:
+		//! constructor, copies the cloud, calls NearestNeighbourSearch<T>(points)
+		KDTreeDynamic(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters);
+		virtual ~KDTreeDynamic();
+		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0) const;
+		virtual unsigned long radiusSearch(const Vector& query, const T radius, std::vector<Index>& indices, std::vector<T>& dists2, const unsigned optionFlags = 0) const;
+		virtual void addPoints(const Matrix& newPoints);
+		virtual void removePoints(const IndexVector& indices);
+	};
+
+	//! Forest of kd-trees over spatial shards of the cloud, built in parallel and queried with bounding-box pruning
+	/** The cloud is partitioned by recursive median splits along the widest dimension; each shard
+	 * owns a compact copy of its points and a tree over them, both allocated and filled by the
+	 * worker thread that builds the shard, so that first-touch page placement keeps shard storage
+	 * local to that worker's NUMA node. A query only descends into the shards whose bounding
+	 * boxes can still contain a point closer than the current worst candidate. */
+	template<typename T, typename Heap, typename Cloud_T = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >
+	struct KDTreeForest: public NearestNeighbourSearch<T, Cloud_T>
+	{
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Vector Vector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Matrix Matrix;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::Index Index;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexVector IndexVector;
+		typedef typename NearestNeighbourSearch<T, Cloud_T>::IndexMatrix IndexMatrix;
+		typedef Cloud_T CloudType;
+
+		using NearestNeighbourSearch<T, Cloud_T>::dim;
+		using NearestNeighbourSearch<T, Cloud_T>::cloud;
+		using NearestNeighbourSearch<T, Cloud_T>::creationOptionFlags;
+		using NearestNeighbourSearch<T, Cloud_T>::minBound;
+		using NearestNeighbourSearch<T, Cloud_T>::maxBound;
+		using NearestNeighbourSearch<T, Cloud_T>::checkSizesKnn;
+
+	protected:
+		//! type of the per-shard trees
+		typedef KDTreeUnbalancedPtInLeavesImplicitBoundsStackOpt<T, Heap> Tree;
+
+		//! one spatial shard: a compact copy of its points, their indices in the cloud, and a tree
+		struct Shard
+		{
+			//! copy of the points of this shard, one per column
+			typename Tree::Matrix points;
+			//! for each column of points, its index in the cloud
+			std::vector<Index> globalIndices;
+			//! tree over points; its minBound/maxBound are the bounding box of the shard
+			Tree* tree;
+			Shard(): tree(0) {}
+			~Shard() { delete tree; }
+		};
+
+		//! the shards, covering the cloud
+		std::vector<Shard*> shards;
+
+		//! maximum number of threads to use for batch queries, 0 for OpenMP default
+		const unsigned maxThreads;
+
+		//! return the squared distance from a query point to the bounding box of a shard, 0 if inside
+		T dist2ToShard(const Vector& query, const Shard& shard) const;
+
+	public:
+		//! constructor, partitions the cloud and builds one tree per shard, calls NearestNeighbourSearch<T>(cloud)
+		KDTreeForest(const CloudType& cloud, const Index dim, const unsigned creationOptionFlags, const Parameters& additionalParameters);
+		virtual ~KDTreeForest();
+		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Vector& maxRadii, const Index k = 1, const T epsilon = 0, const unsigned optionFlags = 0) const;
+	};
+
 	#ifdef HAVE_OPENCL
-	
-	//! OpenCL support for nearest neighbour search	
+
+	//! OpenCL support for nearest neighbour search
 	template<typename T>
 	struct OpenCLSearch: public NearestNeighbourSearch<T>
 	{
@@ -239,10 +582,35 @@ namespace Nabo
 	protected:
 		const cl_device_type deviceType; //!< the type of device to run CL code on (CL_DEVICE_TYPE_CPU or CL_DEVICE_TYPE_GPU)
 		cl::Context& context; //!< the CL context
+		cl::Program clProgram; //!< the program holding the kernels of this search
 		mutable cl::Kernel knnKernel; //!< the kernel to perform knnSearch, mutable because it is stateful, but conceptually const
-		cl::CommandQueue queue; //!< the command queue
+		mutable cl::CommandQueue queue; //!< the command queue
 		cl::Buffer cloudCL; //!< the buffer for the input data
-		
+
+		//! one slot of the query pipeline, with persistent pinned staging buffers reused across batches
+		struct PipelineSlot
+		{
+			cl::Buffer queryCL; //!< pinned staging buffer for the query points
+			cl::Buffer indicesCL; //!< pinned staging buffer for the result indices
+			cl::Buffer dists2CL; //!< pinned staging buffer for the result squared distances
+			cl::Buffer visitCountCL; //!< pinned staging buffer for the per-query visit counts
+			size_t queryCapacity; //!< size of queryCL in bytes
+			size_t indicesCapacity; //!< size of indicesCL in bytes
+			size_t dists2Capacity; //!< size of dists2CL in bytes
+			size_t visitCountCapacity; //!< size of visitCountCL in bytes
+			std::vector<cl_uint> visitCounts; //!< host destination of the visit counts
+			cl::CommandQueue queue; //!< in-order queue of this slot; separate queues let the device overlap the commands of different batches
+			cl::Event done; //!< completion event of the last readback enqueued on this slot
+			bool pending; //!< whether a batch is in flight on this slot
+			//! constructor, no buffer allocated yet
+			PipelineSlot(): queryCapacity(0), indicesCapacity(0), dists2Capacity(0), visitCountCapacity(0), pending(false) {}
+		};
+		//! number of pipeline slots; two, so that one batch transfers while the other computes
+		enum { slotCount = 2 };
+		mutable PipelineSlot slots[slotCount]; //!< the query pipeline
+		mutable int currentSlot; //!< slot the next batch will be enqueued on
+		mutable unsigned long accumulatedVisitCount; //!< visit counts of batches drained when their slot was reused, not yet returned by knnFinish()
+
 		//! constructor, calls NearestNeighbourSearch<T>(cloud)
 		OpenCLSearch(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const cl_device_type deviceType);
 		//! Initialize CL support
@@ -251,9 +619,22 @@ namespace Nabo
 		 * \param additionalDefines additional CL code to pass to compiler
 		 */
 		void initOpenCL(const char* clFileName, const char* kernelName, const std::string& additionalDefines = "");
-	
+
+		//! make sure buffer holds at least size bytes, growing it geometrically if needed
+		void growBuffer(cl::Buffer& buffer, size_t& capacity, const cl_mem_flags flags, const size_t size) const;
+
 	public:
 		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+
+		//! Enqueue a batch without waiting for its completion
+		/*!	The batch runs through a double-buffered pipeline of persistent pinned staging buffers,
+		 *	so the device-side execution of one batch overlaps the transfers of its neighbours.
+		 *	The query, indices, and dists2 matrices must stay alive and untouched until knnFinish() has returned.
+		 *	The parameters are those of the matrix version of knn(). */
+		void knnEnqueue(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		//! Wait for all enqueued batches; their result matrices are valid once this returns
+		/*!	\return the total number of points touched by the finished batches, if creationOptionFlags contains TOUCH_STATISTICS */
+		unsigned long knnFinish() const;
 	};
 	
 	//! KDTree, balanced, points in leaves, stack, implicit bounds, balance aspect ratio
@@ -263,11 +644,33 @@ namespace Nabo
 		typedef typename NearestNeighbourSearch<T>::Vector Vector;
 		typedef typename NearestNeighbourSearch<T>::Matrix Matrix;
 		typedef typename NearestNeighbourSearch<T>::Index Index;
+		typedef typename NearestNeighbourSearch<T>::IndexMatrix IndexMatrix;
 		
+		using NearestNeighbourSearch<T>::cloud;
+		using NearestNeighbourSearch<T>::creationOptionFlags;
+		using NearestNeighbourSearch<T>::checkSizesKnn;
 		using OpenCLSearch<T>::initOpenCL;
+		using OpenCLSearch<T>::context;
+		using OpenCLSearch<T>::queue;
+		using OpenCLSearch<T>::cloudCL;
+		using OpenCLSearch<T>::clProgram;
+		using OpenCLSearch<T>::growBuffer;
 		
 		//! constructor, calls OpenCLSearch<T>(cloud, ...)
 		BruteForceSearchOpenCL(const Matrix& cloud, const Index dim, const unsigned creationOptionFlags, const cl_device_type deviceType);
+		
+		virtual unsigned long knn(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const T epsilon, const unsigned optionFlags, const T maxRadius) const;
+		
+	protected:
+		mutable cl::Kernel partialKernel; //!< phase-one kernel of the large-k path, per-work-group partial top k in local memory
+		mutable cl::Kernel mergeKernel; //!< phase-two kernel of the large-k path, merges the partial lists of each query
+		mutable cl::Buffer partialIndicesCL; //!< device scratch holding the indices of the partial lists
+		mutable cl::Buffer partialDists2CL; //!< device scratch holding the squared distances of the partial lists
+		mutable size_t partialIndicesCapacity; //!< size of partialIndicesCL in bytes
+		mutable size_t partialDists2Capacity; //!< size of partialDists2CL in bytes
+		
+		//! two-phase on-device search for k beyond the private-memory limit of the single kernel
+		unsigned long knnLargeK(const Matrix& query, IndexMatrix& indices, Matrix& dists2, const Index k, const unsigned optionFlags, const T maxRadius) const;
 	};
 	
 	//! KDTree, balanced, points in leaves, stack, implicit bounds, balance aspect ratio
@@ -35,3 +35,25 @@ void heapCopy(global int* indices, global T* dists2, const HeapEntry* heap, cons
 void heapSort(const HeapEntry* heap)
 {
 }
+
+// variants of the list operations above, on a k-best list shared by a
+// work group in local memory
+
+T lheapHeadValue(const local HeapEntry* heap)
+{
+	return heap->value;
+}
+
+void lheapHeadReplace(local HeapEntry* heap, const int index, const T value, const uint K)
+{
+	uint i = 0;
+	for (; i < K - 1; ++i)
+	{
+		if (heap[i + 1].value > value)
+			heap[i] = heap[i + 1];
+		else
+			break;
+	}
+	heap[i].value = value;
+	heap[i].index = index;
+}
@@ -45,3 +45,113 @@ kernel void knnBruteForce(const global T* cloud,
 	touchStatistics[queryId] = pointCount;
 	#endif
 }
+
+#ifdef LARGE_MAX_K
+
+kernel void knnBruteForcePartial(const global T* cloud,
+						const global T* query,
+						global int* partialIndices,
+						global T* partialDists2,
+						const uint K,
+						const T maxRadius2,
+						const uint optionFlags,
+						const uint pointCount,
+						const uint partCount)
+{
+	// the k-best list is shared by the work group in local memory, so large
+	// K do not spill the private registers of each work item
+	local HeapEntry heap[LARGE_MAX_K];
+	local T tileDists2[LARGE_K_GROUP_SIZE];
+	local int tileIndices[LARGE_K_GROUP_SIZE];
+	
+	const uint part = get_group_id(0);
+	const uint queryId = get_global_id(1);
+	const uint lid = get_local_id(0);
+	const bool allowSelfMatch = optionFlags & ALLOW_SELF_MATCH;
+	const global T* q = &query[queryId * POINT_STRIDE];
+	
+	for (uint i = lid; i < K; i += LARGE_K_GROUP_SIZE)
+		heap[i].value = HUGE_VALF;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	// scan this part's slice of the cloud, one tile of distances at a time
+	for (uint tile = part * LARGE_K_GROUP_SIZE; tile < pointCount; tile += partCount * LARGE_K_GROUP_SIZE)
+	{
+		const uint index = tile + lid;
+		T dist = HUGE_VALF;
+		if (index < pointCount)
+		{
+			const global T* p = &cloud[index * POINT_STRIDE];
+			dist = 0;
+			for (uint i = 0; i < DIM_COUNT; ++i)
+			{
+				const T diff = q[i] - p[i];
+				dist += diff * diff;
+			}
+			if ((dist > maxRadius2) || (!allowSelfMatch && (dist == 0)))
+				dist = HUGE_VALF;
+		}
+		tileDists2[lid] = dist;
+		tileIndices[lid] = index;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid == 0)
+		{
+			for (uint i = 0; i < LARGE_K_GROUP_SIZE; ++i)
+				if (tileDists2[i] < lheapHeadValue(heap))
+					lheapHeadReplace(heap, tileIndices[i], tileDists2[i], K);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	
+	// write this part's candidates, ascending as heapCopy does
+	const uint base = (queryId * partCount + part) * K;
+	for (uint i = lid; i < K; i += LARGE_K_GROUP_SIZE)
+	{
+		partialIndices[base + i] = heap[K - i - 1].index;
+		partialDists2[base + i] = heap[K - i - 1].value;
+	}
+}
+
+kernel void knnBruteForceMerge(const global int* partialIndices,
+						const global T* partialDists2,
+						global int* indices,
+						global T* dists2,
+						const uint K,
+						const uint partCount,
+						const uint indexStride,
+						const uint dists2Stride)
+{
+	local HeapEntry heap[LARGE_MAX_K];
+	
+	const uint queryId = get_group_id(0);
+	const uint lid = get_local_id(0);
+	
+	for (uint i = lid; i < K; i += LARGE_K_GROUP_SIZE)
+		heap[i].value = HUGE_VALF;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	// partial lists are sorted, so each stops contributing at its first rejection
+	if (lid == 0)
+	{
+		for (uint part = 0; part < partCount; ++part)
+		{
+			const uint base = (queryId * partCount + part) * K;
+			for (uint i = 0; i < K; ++i)
+			{
+				const T dist = partialDists2[base + i];
+				if (dist >= lheapHeadValue(heap))
+					break;
+				lheapHeadReplace(heap, partialIndices[base + i], dist, K);
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	for (uint i = lid; i < K; i += LARGE_K_GROUP_SIZE)
+	{
+		indices[queryId * indexStride + i] = heap[K - i - 1].index;
+		dists2[queryId * dists2Stride + i] = heap[K - i - 1].value;
+	}
+}
+
+#endif // LARGE_MAX_K
@@ -8,6 +8,8 @@
 using namespace boost::python;
 
 typedef Nabo::NNSearchD NNSNabo;
+typedef Nabo::NNSearchStridedD NNSStrided;
+typedef NNSStrided::CloudType MappedCloud;
 typedef NNSNabo::Index Index;
 typedef NNSNabo::SearchType SearchType;
 typedef NNSNabo::SearchOptionFlags SearchOptionFlags;
@@ -17,6 +19,14 @@ typedef Eigen::Map<NNSNabo::IndexMatrix> MappedEigenIndexMatrix;
 static const double infD = std::numeric_limits<double>::infinity();
 static const Index maxI = std::numeric_limits<Index>::max();
 
+//! Release the GIL for the duration of a scope, so that searches from several Python threads run concurrently
+struct GilReleaser
+{
+	GilReleaser(): state(PyEval_SaveThread()) {}
+	~GilReleaser() { PyEval_RestoreThread(state); }
+	PyThreadState* state;
+};
+
 void matrixSizeFromPythonArray(const PyObject* cloudObj, int& rowCount, int& colCount)
 {
 	assert(PyArray_CHKFLAGS(cloudObj, NPY_C_CONTIGUOUS) || PyArray_CHKFLAGS(cloudObj, NPY_F_CONTIGUOUS));
@@ -34,7 +44,7 @@ void matrixSizeFromPythonArray(const PyObject* cloudObj, int& rowCount, int& col
 	}
 }
 
-void checkPythonArray(const PyObject* cloudObj, const char *paramName)
+void checkPythonArray(const PyObject* cloudObj, const char *paramName, const int expectedType = NPY_FLOAT64, const char *expectedTypeName = "doubles")
 {
 	std::string startMsg("Argument \"");
 	startMsg += paramName;
@@ -45,8 +55,8 @@ void checkPythonArray(const PyObject* cloudObj, const char *paramName)
 	const int nDim = PyArray_NDIM(cloudObj);
 	if (nDim != 2)
 		throw std::runtime_error(startMsg + "must be a two-dimensional array");
-	if (PyArray_TYPE(cloudObj) != NPY_FLOAT64)
-		throw std::runtime_error(startMsg + "must hold doubles");
+	if (PyArray_TYPE(cloudObj) != expectedType)
+		throw std::runtime_error(startMsg + "must hold " + expectedTypeName);
 	if (!PyArray_CHKFLAGS(cloudObj, NPY_C_CONTIGUOUS) && !PyArray_CHKFLAGS(cloudObj, NPY_F_CONTIGUOUS))
 		throw std::runtime_error(startMsg + "must be a continuous array");
 }
@@ -64,26 +74,19 @@ MappedEigenDoubleMatrix* eigenFromBoostPython(const object cloudIn, const char *
 	return new MappedEigenDoubleMatrix(cloudData, dimCount, pointCount);
 }
 
-void eigenFromBoostPython(NNSNabo::Matrix& cloudOut, const object cloudIn, const char *paramName)
-{
-	int dimCount, pointCount;
-	const PyObject *cloudObj(cloudIn.ptr());
-	
-	checkPythonArray(cloudObj, paramName);
-	
-	matrixSizeFromPythonArray(cloudObj, dimCount, pointCount);
-	cloudOut.resize(dimCount, pointCount);
-	
-	memcpy(cloudOut.data(), PyArray_DATA(cloudObj), pointCount*dimCount*sizeof(double));
-}
-
 class NearestNeighbourSearch
 {
 public:
-	NearestNeighbourSearch(const object pycloud, const SearchType searchType = NNSNabo::KDTREE_LINEAR_HEAP, const Index dim = maxI, const dict params = dict())
+	NearestNeighbourSearch(const object pycloud, const SearchType searchType = NNSNabo::KDTREE_LINEAR_HEAP, const Index dim = maxI, const dict params = dict()):
+		cloudRef(pycloud)
 	{
-		// build cloud
-		eigenFromBoostPython(cloud, pycloud, "cloud");
+		// map cloud in place; cloudRef keeps the underlying buffer alive
+		int dimCount, pointCount;
+		const PyObject *cloudObj(pycloud.ptr());
+		checkPythonArray(cloudObj, "cloud");
+		matrixSizeFromPythonArray(cloudObj, dimCount, pointCount);
+		const double* cloudData(reinterpret_cast<const double*>(PyArray_DATA(cloudObj)));
+		cloud = new MappedCloud(cloudData, dimCount, pointCount, Eigen::OuterStride<>(dimCount));
 		
 		// build params
 		Nabo::Parameters _params;
@@ -105,43 +108,84 @@ public:
 		}
 		
 		// create search
-		nns = NNSNabo ::create(cloud, dim, searchType, 0, _params);
+		nns = NNSStrided::create(*cloud, dim, static_cast<NNSStrided::SearchType>(searchType), 0, _params);
 	}
 	
 	~NearestNeighbourSearch()
 	{
 		delete nns;
+		delete cloud;
 	}
 	
 	tuple knn(const object query, const Index k = 1, const double epsilon = 0, const unsigned optionFlags = 0, const double maxRadius = infD)
 	{
-		// map query and create output matrices
+		// map query and create output arrays
 		MappedEigenDoubleMatrix* mappedQuery(eigenFromBoostPython(query, "query"));
-		NNSNabo::IndexMatrix indexMatrix(k, mappedQuery->cols());
-		NNSNabo::Matrix dists2Matrix(k, mappedQuery->cols());
-		
-		// do the search
-		nns->knn(*mappedQuery, indexMatrix, dists2Matrix, k, epsilon, optionFlags, maxRadius);
-		
-		// build resulting python types
 		npy_intp retDims[2] = { mappedQuery->cols(), k };
 		const int dataCount(k * mappedQuery->cols());
 		PyObject* dists2 = PyArray_EMPTY(2, retDims, PyArray_DOUBLE, PyArray_ISFORTRAN(query.ptr()));
-		memcpy(PyArray_DATA(dists2), dists2Matrix.data(), dataCount*sizeof(double));
 		PyObject* indices = PyArray_EMPTY(2, retDims, PyArray_INT, PyArray_ISFORTRAN(query.ptr()));
-		memcpy(PyArray_DATA(indices), indexMatrix.data(), dataCount*sizeof(int));
+		double* dists2Data(reinterpret_cast<double*>(PyArray_DATA(dists2)));
+		int* indicesData(reinterpret_cast<int*>(PyArray_DATA(indices)));
+		
+		// do the search and copy results out, GIL released
+		{
+			GilReleaser releaseGil;
+			NNSNabo::IndexMatrix indexMatrix(k, mappedQuery->cols());
+			NNSNabo::Matrix dists2Matrix(k, mappedQuery->cols());
+			nns->knn(*mappedQuery, indexMatrix, dists2Matrix, k, epsilon, optionFlags, maxRadius);
+			memcpy(dists2Data, dists2Matrix.data(), dataCount*sizeof(double));
+			memcpy(indicesData, indexMatrix.data(), dataCount*sizeof(int));
+		}
 		delete mappedQuery;
 		
 		// return results
 		return make_tuple(object(handle<>(indices)), object(handle<>(dists2)));
 	}
 	
+	unsigned long knnInto(const object query, object indices, object dists2, const Index k = 1, const double epsilon = 0, const unsigned optionFlags = 0, const double maxRadius = infD)
+	{
+		// map query and caller-provided output arrays
+		MappedEigenDoubleMatrix* mappedQuery(eigenFromBoostPython(query, "query"));
+		const int pointCount(mappedQuery->cols());
+		PyObject* indicesObj(indices.ptr());
+		PyObject* dists2Obj(dists2.ptr());
+		checkPythonArray(indicesObj, "indices", NPY_INT, "32-bit integers");
+		checkPythonArray(dists2Obj, "dists2");
+		int indicesK, indicesCount, dists2K, dists2Count;
+		matrixSizeFromPythonArray(indicesObj, indicesK, indicesCount);
+		matrixSizeFromPythonArray(dists2Obj, dists2K, dists2Count);
+		if (indicesK != k || indicesCount != pointCount)
+			throw std::runtime_error("Argument \"indices\" must have k entries per query point in the contiguous dimension");
+		if (dists2K != k || dists2Count != pointCount)
+			throw std::runtime_error("Argument \"dists2\" must have k entries per query point in the contiguous dimension");
+		int* indicesData(reinterpret_cast<int*>(PyArray_DATA(indicesObj)));
+		double* dists2Data(reinterpret_cast<double*>(PyArray_DATA(dists2Obj)));
+		const int dataCount(k * pointCount);
+		
+		// do the search and copy results out, GIL released
+		unsigned long visitCount;
+		{
+			GilReleaser releaseGil;
+			NNSNabo::IndexMatrix indexMatrix(k, pointCount);
+			NNSNabo::Matrix dists2Matrix(k, pointCount);
+			visitCount = nns->knn(*mappedQuery, indexMatrix, dists2Matrix, k, epsilon, optionFlags, maxRadius);
+			memcpy(dists2Data, dists2Matrix.data(), dataCount*sizeof(double));
+			memcpy(indicesData, indexMatrix.data(), dataCount*sizeof(int));
+		}
+		delete mappedQuery;
+		
+		return visitCount;
+	}
+	
 protected:
-	NNSNabo *nns;
-	NNSNabo::Matrix cloud;
+	NNSStrided *nns;
+	MappedCloud *cloud;
+	const object cloudRef;
 };
 
 BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(knn_overloads, knn, 1, 5)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(knn_into_overloads, knnInto, 3, 7)
 
 BOOST_PYTHON_MODULE(pynabo)
 {
@@ -162,6 +206,9 @@ BOOST_PYTHON_MODULE(pynabo)
 		"NearestNeighbourSearch",
 		"Nearest-neighbour search object, containing the data, on which you can do the knn(...) query.\n\n"
 		"The data and query must be continuous numpy arrays.\n"
+		"The data array is mapped in place without copying; it must not be\n"
+		"modified, resized or garbage-collected while this object is alive.\n"
+		"Queries release the GIL, so several Python threads can search concurrently.\n"
 		"As numpy proposes both C and Fortran data orders, pynabo\n"
 		"will always consider the contiguous dimension to be coordinates\n"
 		"of points, regardless of order, as this provides the fastest\n"
@@ -193,5 +240,21 @@ BOOST_PYTHON_MODULE(pynabo)
 			"    A tuple of two 2D numpy arrays, the first containing indices to points in data, the other containing squared distances."
 		)
 	)
+	.def("knn_into", &NearestNeighbourSearch::knnInto,
+		knn_into_overloads(
+			args("self", "query", "indices", "dists2", "k", "epsilon", "optionFlags", "maxRadius"),
+			"Find the k nearest neighbours of query in data, writing results into preallocated arrays.\n\n"
+			"Arguments:\n"
+			"    query -- query points, must be a numpy array\n"
+			"    indices -- preallocated continuous int32 numpy array of shape (query points, k), receives indices to points in data\n"
+			"    dists2 -- preallocated continuous float64 numpy array of shape (query points, k), receives squared distances\n"
+			"    k -- number of nearest neighbour requested, default: 1\n"
+			"    epsilon -- maximal ratio of error for approximate search, 0 for exact search; has no effect if the number of neighbour found is smaller than the number requested; default: 0.\n"
+			"    optionFlags -- search options, a bitwise OR of elements of SearchOptionFlags, default: 0\n"
+			"    maxRadius -- maximum radius in which to search, can be used to prune search, is not affected by epsilon, default: inf\n\n"
+			"Returns:\n"
+			"    The number of point-to-point comparisons performed, when the search was created with TOUCH_STATISTICS, 0 otherwise."
+		)
+	)
 	;
 }
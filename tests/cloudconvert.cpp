@@ -0,0 +1,82 @@
+/*
+
+Copyright (c) 2010--2011, Stephane Magnenat, ASL, ETHZ, Switzerland
+You can contact the author at <stephane at magnenat dot net>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETH-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "nabo/nabo.h"
+#include "helpers.h"
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace Nabo;
+
+/*!	\file cloudconvert.cpp
+	\brief command-line tool to convert a point cloud to the binary cloud file format
+	\ingroup example
+*/
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3 && argc != 4)
+	{
+		cerr << "Usage: " << argv[0] << " INPUT OUTPUT [float|double]" << endl;
+		cerr << "  reads INPUT (text or binary cloud file) and writes it as a binary cloud file to OUTPUT" << endl;
+		return 1;
+	}
+
+	const string scalarType(argc == 4 ? argv[3] : "float");
+	try
+	{
+		if (scalarType == "float")
+		{
+			const NNSearchF::Matrix cloud(load<float>(argv[1]));
+			saveCloudFile<float>(argv[2], cloud);
+			cout << "wrote " << cloud.cols() << " points of dimension " << cloud.rows() << " to " << argv[2] << endl;
+		}
+		else if (scalarType == "double")
+		{
+			const NNSearchD::Matrix cloud(load<double>(argv[1]));
+			saveCloudFile<double>(argv[2], cloud);
+			cout << "wrote " << cloud.cols() << " points of dimension " << cloud.rows() << " to " << argv[2] << endl;
+		}
+		else
+		{
+			cerr << "Unknown scalar type " << scalarType << ", must be float or double" << endl;
+			return 1;
+		}
+	}
+	catch (const std::runtime_error& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
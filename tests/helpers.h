@@ -36,6 +36,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <limits>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <stdexcept>
 
 #ifdef BOOST_STDINT
 	#include <boost/cstdint.hpp>
@@ -52,13 +54,32 @@ typename NearestNeighbourSearch<T>::Matrix load(const char *fileName)
 {
 	typedef typename NearestNeighbourSearch<T>::Matrix Matrix;
 	
-	ifstream ifs(fileName);
+	ifstream ifs(fileName, ios::binary);
 	if (!ifs.good())
 	{
 		cerr << "Cannot open file "<< fileName << endl;
 		exit(1);
 	}
 	
+	// binary cloud files load directly, everything else goes through the text parser
+	char magic[8];
+	ifs.read(magic, sizeof(magic));
+	if (ifs.good() && memcmp(magic, "NABOCLD1", 8) == 0)
+	{
+		ifs.close();
+		try
+		{
+			return Nabo::loadCloudFile<T>(fileName);
+		}
+		catch (const std::runtime_error& e)
+		{
+			cerr << e.what() << endl;
+			exit(1);
+		}
+	}
+	ifs.clear();
+	ifs.seekg(0);
+	
 	vector<T> data;
 	int dim(0);
 	bool firstLine(true);
@@ -0,0 +1,382 @@
+/*
+
+Copyright (c) 2010--2011, Stephane Magnenat, ASL, ETHZ, Switzerland
+You can contact the author at <stephane at magnenat dot net>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETH-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "nabo/nabo.h"
+#include "helpers.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/syscall.h>
+	#include <sys/ioctl.h>
+	#include <unistd.h>
+#endif // __linux__
+
+/*!	\file knnbench2.cpp
+	\brief benchmark suite sweeping search parameters, with hardware counters,
+	JSON output, and stored-baseline regression checking
+	\ingroup test
+*/
+
+using namespace std;
+using namespace Nabo;
+
+typedef Nabo::NearestNeighbourSearch<double> NNS;
+
+//! one hardware performance counter, read around a benchmark run
+struct PerfCounter
+{
+	//! open the counter for this process, available() is false if the kernel refuses
+	PerfCounter(const unsigned type, const unsigned long long config):
+		fd(-1)
+	{
+#ifdef __linux__
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif // __linux__
+	}
+	~PerfCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif // __linux__
+	}
+	//! whether the counter could be opened
+	bool available() const { return fd >= 0; }
+	//! reset and start counting
+	void start()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif // __linux__
+	}
+	//! stop counting and return the count, -1 if unavailable
+	long long stop()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			long long value(-1);
+			if (read(fd, &value, sizeof(value)) == sizeof(value))
+				return value;
+		}
+#endif // __linux__
+		return -1;
+	}
+
+private:
+	int fd; //!< perf event file descriptor, -1 if unavailable
+};
+
+//! one point of the parameter sweep
+struct BenchCase
+{
+	string name; //!< unique name of this case, used as baseline key
+	NNS::SearchType searchType; //!< type of search to create
+	int cloudSize; //!< number of cloud points used
+	int k; //!< number of neighbours requested
+	unsigned bucketSize; //!< bucket size passed at creation
+	double epsilon; //!< approximation ratio passed to knn()
+};
+
+//! measured results of one case, aggregated over repetitions
+struct BenchMeasure
+{
+	double medianSeconds; //!< median wall-clock duration of one batch
+	double meanSeconds; //!< mean wall-clock duration of one batch
+	double stddevSeconds; //!< standard deviation of the batch durations
+	long long cycles; //!< cpu cycles of the median-timed run, -1 if unavailable
+	long long llcMisses; //!< last-level-cache misses of the median-timed run, -1 if unavailable
+};
+
+//! return the median of values, which it sorts
+double median(vector<double>& values)
+{
+	sort(values.begin(), values.end());
+	const size_t count(values.size());
+	if (count % 2 == 1)
+		return values[count / 2];
+	return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+//! run one case, warmupCount unmeasured runs followed by repeatCount measured ones
+BenchMeasure benchCase(const BenchCase& c, const NNS::Matrix& cloud, const NNS::Matrix& query, const int warmupCount, const int repeatCount)
+{
+	const NNS::Matrix subCloud(cloud.block(0, 0, cloud.rows(), c.cloudSize));
+	Parameters params;
+	params["bucketSize"] = c.bucketSize;
+	NNS* nns(NNS::create(subCloud, subCloud.rows(), c.searchType, 0, params));
+
+	NNS::IndexMatrix indices(c.k, query.cols());
+	NNS::Matrix dists2(c.k, query.cols());
+
+	for (int i = 0; i < warmupCount; ++i)
+		nns->knn(query, indices, dists2, c.k, c.epsilon, NNS::SORT_RESULTS);
+
+	PerfCounter cycleCounter(0 /* PERF_TYPE_HARDWARE */, 0 /* PERF_COUNT_HW_CPU_CYCLES */);
+	PerfCounter missCounter(0 /* PERF_TYPE_HARDWARE */, 5 /* PERF_COUNT_HW_CACHE_MISSES */);
+
+	BenchMeasure m;
+	m.cycles = -1;
+	m.llcMisses = -1;
+	vector<double> durations;
+	durations.reserve(repeatCount);
+	double bestDelta(numeric_limits<double>::infinity());
+	vector<double> sorted;
+	for (int i = 0; i < repeatCount; ++i)
+	{
+		cycleCounter.start();
+		missCounter.start();
+		boost::timer t;
+		nns->knn(query, indices, dists2, c.k, c.epsilon, NNS::SORT_RESULTS);
+		const double duration(t.elapsed());
+		const long long cycles(cycleCounter.stop());
+		const long long misses(missCounter.stop());
+		durations.push_back(duration);
+		// keep the counters of the run closest to the running median
+		sorted = durations;
+		const double delta(fabs(duration - median(sorted)));
+		if (delta <= bestDelta)
+		{
+			bestDelta = delta;
+			m.cycles = cycles;
+			m.llcMisses = misses;
+		}
+	}
+	delete nns;
+
+	double sum(0);
+	for (size_t i = 0; i < durations.size(); ++i)
+		sum += durations[i];
+	m.meanSeconds = sum / double(durations.size());
+	double var(0);
+	for (size_t i = 0; i < durations.size(); ++i)
+		var += (durations[i] - m.meanSeconds) * (durations[i] - m.meanSeconds);
+	m.stddevSeconds = sqrt(var / double(durations.size()));
+	m.medianSeconds = median(durations);
+	return m;
+}
+
+//! write all measures as a JSON document
+void writeJson(const char* fileName, const vector<BenchCase>& cases, const vector<BenchMeasure>& measures)
+{
+	ofstream ofs(fileName);
+	if (!ofs.good())
+	{
+		cerr << "Cannot open JSON output file " << fileName << endl;
+		exit(1);
+	}
+	ofs << "[\n";
+	for (size_t i = 0; i < cases.size(); ++i)
+	{
+		const BenchCase& c(cases[i]);
+		const BenchMeasure& m(measures[i]);
+		ofs << "\t{ \"name\": \"" << c.name << "\""
+			<< ", \"searchType\": " << c.searchType
+			<< ", \"cloudSize\": " << c.cloudSize
+			<< ", \"k\": " << c.k
+			<< ", \"bucketSize\": " << c.bucketSize
+			<< ", \"epsilon\": " << c.epsilon
+			<< ", \"medianSeconds\": " << setprecision(9) << m.medianSeconds
+			<< ", \"meanSeconds\": " << m.meanSeconds
+			<< ", \"stddevSeconds\": " << m.stddevSeconds
+			<< ", \"cycles\": " << m.cycles
+			<< ", \"llcMisses\": " << m.llcMisses
+			<< " }" << (i + 1 < cases.size() ? "," : "") << "\n";
+	}
+	ofs << "]\n";
+}
+
+//! write case names and median durations as a baseline file, one "name seconds" pair per line
+void saveBaseline(const char* fileName, const vector<BenchCase>& cases, const vector<BenchMeasure>& measures)
+{
+	ofstream ofs(fileName);
+	if (!ofs.good())
+	{
+		cerr << "Cannot open baseline file " << fileName << " for writing" << endl;
+		exit(1);
+	}
+	for (size_t i = 0; i < cases.size(); ++i)
+		ofs << cases[i].name << " " << setprecision(9) << measures[i].medianSeconds << "\n";
+}
+
+//! compare medians against a stored baseline, return the number of regressions beyond threshold
+int checkBaseline(const char* fileName, const vector<BenchCase>& cases, const vector<BenchMeasure>& measures, const double threshold)
+{
+	ifstream ifs(fileName);
+	if (!ifs.good())
+	{
+		cerr << "Cannot open baseline file " << fileName << endl;
+		exit(1);
+	}
+	map<string, double> baseline;
+	string name;
+	double seconds;
+	while (ifs >> name >> seconds)
+		baseline[name] = seconds;
+
+	int regressionCount(0);
+	for (size_t i = 0; i < cases.size(); ++i)
+	{
+		const map<string, double>::const_iterator it(baseline.find(cases[i].name));
+		if (it == baseline.end())
+		{
+			cout << "  new case " << cases[i].name << ", no baseline" << endl;
+			continue;
+		}
+		const double ratio(measures[i].medianSeconds / it->second);
+		if (ratio > 1 + threshold)
+		{
+			cout << "  REGRESSION " << cases[i].name << ": " << measures[i].medianSeconds
+				<< " s vs baseline " << it->second << " s (+" << (ratio - 1) * 100 << " %)" << endl;
+			++regressionCount;
+		}
+	}
+	return regressionCount;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cerr << "Usage: " << argv[0] << " DATA [--queries N] [--warmup N] [--repeat N] [--json FILE] [--save-baseline FILE] [--check-baseline FILE] [--threshold RATIO]" << endl;
+		return 1;
+	}
+
+	int queryCount(10000);
+	int warmupCount(1);
+	int repeatCount(7);
+	double threshold(0.1);
+	const char* jsonFile(0);
+	const char* saveBaselineFile(0);
+	const char* checkBaselineFile(0);
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+			queryCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+			warmupCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeatCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			jsonFile = argv[++i];
+		else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc)
+			saveBaselineFile = argv[++i];
+		else if (strcmp(argv[i], "--check-baseline") == 0 && i + 1 < argc)
+			checkBaselineFile = argv[++i];
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else
+		{
+			cerr << "Unknown argument " << argv[i] << endl;
+			return 1;
+		}
+	}
+
+	const NNS::Matrix cloud(load<double>(argv[1]));
+	const NNS::Matrix query(createQuery<double>(cloud, queryCount, 0));
+
+	// parameter sweep
+	const NNS::SearchType searchTypes[] = { NNS::KDTREE_LINEAR_HEAP, NNS::KDTREE_TREE_HEAP };
+	const int ks[] = { 1, 4, 16 };
+	const unsigned bucketSizes[] = { 8, 32 };
+	const double epsilons[] = { 0, 0.1 };
+	const int cloudSizes[] = { int(cloud.cols()) / 4, int(cloud.cols()) };
+	vector<BenchCase> cases;
+	for (size_t ti = 0; ti < sizeof(searchTypes)/sizeof(searchTypes[0]); ++ti)
+		for (size_t si = 0; si < sizeof(cloudSizes)/sizeof(cloudSizes[0]); ++si)
+			for (size_t ki = 0; ki < sizeof(ks)/sizeof(ks[0]); ++ki)
+				for (size_t bi = 0; bi < sizeof(bucketSizes)/sizeof(bucketSizes[0]); ++bi)
+					for (size_t ei = 0; ei < sizeof(epsilons)/sizeof(epsilons[0]); ++ei)
+					{
+						BenchCase c;
+						c.searchType = searchTypes[ti];
+						c.cloudSize = cloudSizes[si];
+						c.k = ks[ki];
+						c.bucketSize = bucketSizes[bi];
+						c.epsilon = epsilons[ei];
+						ostringstream oss;
+						oss << "type" << c.searchType << "-n" << c.cloudSize << "-k" << c.k << "-b" << c.bucketSize << "-e" << c.epsilon;
+						c.name = oss.str();
+						cases.push_back(c);
+					}
+
+	vector<BenchMeasure> measures;
+	for (size_t i = 0; i < cases.size(); ++i)
+	{
+		const BenchMeasure m(benchCase(cases[i], cloud, query, warmupCount, repeatCount));
+		measures.push_back(m);
+		cout << cases[i].name << ": median " << m.medianSeconds << " s, mean " << m.meanSeconds
+			<< " s, stddev " << m.stddevSeconds << " s";
+		if (m.cycles >= 0)
+			cout << ", " << m.cycles << " cycles";
+		if (m.llcMisses >= 0)
+			cout << ", " << m.llcMisses << " LLC misses";
+		cout << endl;
+	}
+
+	if (jsonFile)
+		writeJson(jsonFile, cases, measures);
+	if (saveBaselineFile)
+		saveBaseline(saveBaselineFile, cases, measures);
+	if (checkBaselineFile)
+	{
+		const int regressionCount(checkBaseline(checkBaselineFile, cases, measures, threshold));
+		if (regressionCount > 0)
+		{
+			cerr << regressionCount << " cases regressed beyond " << threshold * 100 << " %" << endl;
+			return 2;
+		}
+	}
+
+	return 0;
+}
@@ -60,12 +60,19 @@ void validate(const char *fileName, const int K, const int method, const T maxRa
 	
 	// create different methods
 	NNSV nnss;
-	unsigned searchTypeCount(NNS::SEARCH_TYPE_COUNT);
-	#ifndef HAVE_OPENCL
-	searchTypeCount -= 3;
+	vector<typename NNS::SearchType> searchTypes;
+	searchTypes.push_back(NNS::BRUTE_FORCE);
+	searchTypes.push_back(NNS::KDTREE_LINEAR_HEAP);
+	searchTypes.push_back(NNS::KDTREE_TREE_HEAP);
+	#ifdef HAVE_OPENCL
+	searchTypes.push_back(NNS::KDTREE_CL_PT_IN_NODES);
+	searchTypes.push_back(NNS::KDTREE_CL_PT_IN_LEAVES);
+	searchTypes.push_back(NNS::BRUTE_FORCE_CL);
 	#endif // HAVE_OPENCL
-	for (unsigned i = 0; i < searchTypeCount; ++i)
-		nnss.push_back(NNS::create(d, d.rows(), typename NNS::SearchType(i)));
+	searchTypes.push_back(NNS::KDTREE_DYNAMIC);
+	searchTypes.push_back(NNS::KDTREE_FOREST);
+	for (size_t i = 0; i < searchTypes.size(); ++i)
+		nnss.push_back(NNS::create(d, d.rows(), searchTypes[i]));
 	//nnss.push_back(new KDTreeBalancedPtInLeavesStack<T>(d, false));
 	
 	
@@ -176,6 +183,99 @@ void validate(const char *fileName, const int K, const int method, const T maxRa
 		}
 	}
 	
+	// check the dynamic tree again after additions and removals, which the loop
+	// above only exercises in its post-construction state
+	{
+		// build over half of the points, add the rest below the rebuild threshold
+		const Index initCount(d.cols() / 2);
+		const Matrix dInit(d.leftCols(initCount));
+		NNS* dyn(NNS::create(dInit, d.rows(), NNS::KDTREE_DYNAMIC, 0, Parameters("rebuildThreshold", unsigned(2 * d.cols()))));
+		dyn->addPoints(d.rightCols(d.cols() - initCount));
+
+		// remove every seventh point
+		vector<bool> isRemoved(d.cols(), false);
+		Index removedCount(0);
+		for (Index i = 0; i < d.cols(); i += 7)
+		{
+			isRemoved[i] = true;
+			++removedCount;
+		}
+		IndexVector toRemove(removedCount);
+		Index j(0);
+		for (Index i = 0; i < d.cols(); ++i)
+			if (isRemoved[i])
+				toRemove(j++) = i;
+		dyn->removePoints(toRemove);
+
+		// brute-force reference over the live points
+		Matrix live(d.rows(), d.cols() - removedCount);
+		j = 0;
+		for (Index i = 0; i < d.cols(); ++i)
+			if (!isRemoved[i])
+				live.col(j++) = d.col(i);
+		NNS* bf(NNS::create(live, live.rows(), NNS::BRUTE_FORCE));
+
+		const int kLive(min(K, int(live.cols()) - 1));
+		IndexMatrix indexes_live(kLive, q.cols()), indexes_dyn(kLive, q.cols());
+		Matrix dists2_live(kLive, q.cols()), dists2_dyn(kLive, q.cols());
+		bf->knn(q, indexes_live, dists2_live, kLive, 0, NNS::SORT_RESULTS, maxRadius);
+		dyn->knn(q, indexes_dyn, dists2_dyn, kLive, 0, NNS::SORT_RESULTS, maxRadius);
+		for (int i = 0; i < q.cols(); ++i)
+		{
+			for (int k = 0; k < kLive; ++k)
+			{
+				if (dists2_live(k,i) == numeric_limits<float>::infinity())
+					continue;
+				const int pdyn(indexes_dyn(k,i));
+				if (pdyn < 0 || pdyn >= dyn->cloud.cols())
+				{
+					cerr << "Dynamic tree after mutation, query point " << i << ", neighbour " << k << " of " << kLive << " has invalid index " << pdyn << " out of range [0:" << dyn->cloud.cols() << "[" << endl;
+					exit(4);
+				}
+				if (isRemoved[pdyn])
+				{
+					cerr << "Dynamic tree after mutation, query point " << i << ", neighbour " << k << " of " << kLive << " is removed point " << pdyn << endl;
+					exit(4);
+				}
+				const Vector pq(q.col(i));
+				const float distDiff(fabsf(dists2_live(k,i) - (dyn->cloud.col(pdyn)-pq).squaredNorm()));
+				if (distDiff > numeric_limits<float>::epsilon())
+				{
+					cerr << "Dynamic tree after mutation, query point " << i << ", neighbour " << k << " of " << kLive << " is different between bf and dynamic tree (dist2 " << distDiff << ")\n";
+					cerr << "* indexes " << indexes_live(k,i) << " (bf over live) vs " << pdyn << " (dynamic)" << endl;
+					exit(4);
+				}
+			}
+		}
+
+		// radius search against the brute-force scan of the live points
+		const T radius(sqrt((d.rowwise().maxCoeff() - d.rowwise().minCoeff()).squaredNorm()) / 10);
+		for (int i = 0; i < min<int>(q.cols(), 10); ++i)
+		{
+			const Vector pq(q.col(i));
+			vector<Index> indexes_rl, indexes_rd;
+			vector<T> dists2_rl, dists2_rd;
+			bf->radiusSearch(pq, radius, indexes_rl, dists2_rl, NNS::SORT_RESULTS);
+			dyn->radiusSearch(pq, radius, indexes_rd, dists2_rd, NNS::SORT_RESULTS);
+			if (indexes_rl.size() != indexes_rd.size())
+			{
+				cerr << "Dynamic tree after mutation, query point " << i << ", radius search found " << indexes_rd.size() << " points instead of " << indexes_rl.size() << endl;
+				exit(3);
+			}
+			for (size_t k = 0; k < indexes_rl.size(); ++k)
+			{
+				if (fabsf(dists2_rl[k] - dists2_rd[k]) > numeric_limits<float>::epsilon())
+				{
+					cerr << "Dynamic tree after mutation, query point " << i << ", radius result " << k << " is different between bf and dynamic tree (" << dists2_rl[k] << " vs " << dists2_rd[k] << ")" << endl;
+					exit(4);
+				}
+			}
+		}
+
+		delete bf;
+		delete dyn;
+	}
+
 // 	cout << "\tstats kdtree: "
 // 		<< kdt.getStatistics().totalVisitCount << " on "
 // 		<< (long long)(itCount) * (long long)(d.cols()) << " ("